@@ -14,7 +14,13 @@
 
 #include <linux/fs.h>
 #include <linux/bitops.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/kthread.h>
 #include "pram.h"
+#include "ntstore.h"
+#include "freetree.h"
+#include "extents.h"
 
 void pram_bitmap_fill(unsigned long *dst, int nbits)
 {
@@ -45,42 +51,890 @@ void pram_init_bitmap(struct super_block *sb)
 }
 
 
+/* Return the bitmap block that holds the in-use bit of blocknr */
+static inline void *pram_bitmap_block(struct super_block *sb,
+				      unsigned long blocknr)
+{
+	unsigned long bitmap_bnr = blocknr >> (3 + sb->s_blocksize_bits);
+	return pram_get_block(sb, pram_get_block_off(sb, bitmap_bnr));
+}
+
+/*
+ * Set or clear the bits [start, start + len) of the bitmap, a whole word
+ * at a time where possible. The bitmap must be writeable before calling.
+ */
+static void pram_bitmap_set_run(unsigned long *bitmap, unsigned long start,
+				unsigned long len, int inuse)
+{
+	while (len && (start & (BITS_PER_LONG - 1))) {
+		if (inuse)
+			pram_set_bit(start, bitmap);
+		else
+			pram_clear_bit(start, bitmap);
+		start++;
+		len--;
+	}
+	while (len >= BITS_PER_LONG) {
+		bitmap[start / BITS_PER_LONG] = inuse ? ~0UL : 0;
+		start += BITS_PER_LONG;
+		len -= BITS_PER_LONG;
+	}
+	while (len--) {
+		if (inuse)
+			pram_set_bit(start, bitmap);
+		else
+			pram_clear_bit(start, bitmap);
+		start++;
+	}
+}
+
+/*
+ * Mark in use, or free, the run of blocks [start, start + len) in the
+ * bitmap. Called with the lock of the allocation group held.
+ */
+static void pram_bitmap_mark_run(struct super_block *sb, unsigned long start,
+				 unsigned long len, int inuse)
+{
+	/*
+	 * find the blocks within the bitmap that contain the inuse bits
+	 * of the run. We need to unlock them to change the bits.
+	 */
+	void *bp = pram_bitmap_block(sb, start);
+	unsigned long size = pram_bitmap_block(sb, start + len - 1) - bp +
+			     sb->s_blocksize;
+
+	pram_memunlock_range(sb, bp, size);
+	pram_bitmap_set_run(pram_get_bitmap(sb), start, len, inuse);
+	pram_memlock_range(sb, bp, size);
+}
+
+/*
+ * Zero size bytes of new blocks at bp, a write window at a time. They
+ * aren't linked anywhere yet, so they're written as file data even if
+ * they're going to hold metadata.
+ */
+static void pram_zero_blocks(struct super_block *sb, void *bp,
+			     unsigned long size)
+{
+	unsigned long len;
+
+	for (; size; size -= len, bp += len) {
+		len = min_t(unsigned long, size, PRAM_WP_BATCH);
+		pram_memzero(pram_memunlock_data(sb, bp, len), len);
+		pram_memlock_data(sb, bp, len);
+	}
+}
+
+/*
+ * Update the free blocks counter by delta. It's only in DRAM, the super
+ * block is updated by the next checkpoint.
+ */
+static inline void pram_add_free_blocks(struct super_block *sb, long delta)
+{
+	percpu_counter_add(&PRAM_SB(sb)->s_freeblocks_counter, delta);
+	pram_dirty_counters(sb);
+}
+
+/*
+ * Allocation groups.
+ *
+ * The data blocks are split in groups whose in-use bits fill exactly one
+ * page of the bitmap, so two groups never share a bitmap word or write
+ * protect the same page. Every group has its own lock, free blocks tree,
+ * free count and allocation hint, so writers working in different groups
+ * don't contend.
+ */
+static inline struct pram_alloc_group *
+pram_get_group(struct super_block *sb, unsigned long blocknr)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	return &sbi->s_groups[(blocknr + sbi->s_group_skew) >>
+			      PRAM_GROUP_SHIFT];
+}
+
+/*
+ * The group to try first: the one of goal if it's a valid block number,
+ * otherwise the one of the current CPU.
+ */
+static unsigned int pram_goal_group(struct super_block *sb,
+				    unsigned long goal)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+
+	if (goal && goal < pram_blocks_count(ps))
+		return (goal + sbi->s_group_skew) >> PRAM_GROUP_SHIFT;
+	return raw_smp_processor_id() % sbi->s_groups_count;
+}
+
+/*
+ * Index in the free blocks trees of the groups all the free runs of the
+ * bitmap. It returns in free the number of free blocks.
+ */
+static void pram_index_free_runs(struct super_block *sb, unsigned long *free)
+{
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long *bitmap = pram_get_bitmap(sb);
+	unsigned long num_blocks = pram_blocks_count(ps);
+	unsigned long bnr = be32_to_cpu(ps->s_bitmap_blocks);
+	unsigned long end;
+	struct pram_alloc_group *ag;
+
+	*free = 0;
+	while (bnr < num_blocks) {
+		bnr = pram_find_next_zero_bit(bitmap, num_blocks, bnr);
+		if (bnr >= num_blocks)
+			break;
+		/* a free run in the tree never crosses a group boundary */
+		ag = pram_get_group(sb, bnr);
+		end = pram_find_next_bit(bitmap, ag->end, bnr);
+		mutex_lock(&ag->lock);
+		pram_free_tree_insert(&ag->free_tree, bnr, end - bnr);
+		ag->free += end - bnr;
+		mutex_unlock(&ag->lock);
+		*free += end - bnr;
+		bnr = end;
+		cond_resched();
+	}
+}
+
+/*
+ * Set up the allocation groups and index the free runs of the bitmap.
+ * It's the only full scan of the bitmap, done at mount time. It returns
+ * in free the number of free blocks.
+ */
+int pram_init_alloc_groups(struct super_block *sb, unsigned long *free)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long num_blocks = pram_blocks_count(ps);
+	struct pram_alloc_group *ag;
+	unsigned int i, count;
+
+	/* The bitmap can start in the middle of a page */
+	sbi->s_group_skew = (be64_to_cpu(ps->s_bitmap_start) &
+			     ~PAGE_MASK) << 3;
+	count = ((num_blocks - 1 + sbi->s_group_skew) >> PRAM_GROUP_SHIFT) + 1;
+
+	sbi->s_groups = kcalloc(count, sizeof(*ag), GFP_KERNEL);
+	if (!sbi->s_groups)
+		return -ENOMEM;
+	sbi->s_groups_count = count;
+
+	for (i = 0; i < count; i++) {
+		ag = &sbi->s_groups[i];
+		mutex_init(&ag->lock);
+		ag->free_tree = RB_ROOT;
+		ag->start = i ? ((unsigned long)i << PRAM_GROUP_SHIFT) -
+				sbi->s_group_skew : 0;
+		ag->end = min(((unsigned long)(i + 1) << PRAM_GROUP_SHIFT) -
+			      sbi->s_group_skew, num_blocks);
+		ag->hint = ag->start;
+	}
+
+	pram_index_free_runs(sb, free);
+	return 0;
+}
+
+/*
+ * Index again the free runs after the bitmap has been rebuilt, when an
+ * unclean fs mounted read-only is remounted read-write. Nothing allocates
+ * on a read-only fs, the group locks only keep off the readers.
+ */
+void pram_reset_alloc_groups(struct super_block *sb, unsigned long *free)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_alloc_group *ag;
+	unsigned int i;
+
+	for (i = 0; i < sbi->s_groups_count; i++) {
+		ag = &sbi->s_groups[i];
+		mutex_lock(&ag->lock);
+		pram_free_tree_erase(&ag->free_tree);
+		ag->free = 0;
+		ag->hint = ag->start;
+		mutex_unlock(&ag->lock);
+	}
+	pram_index_free_runs(sb, free);
+}
+
+void pram_destroy_alloc_groups(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned int i;
+
+	if (!sbi->s_groups)
+		return;
+	for (i = 0; i < sbi->s_groups_count; i++)
+		pram_free_tree_erase(&sbi->s_groups[i].free_tree);
+	kfree(sbi->s_groups);
+	sbi->s_groups = NULL;
+}
+
+/* Return the lowest free block, or 0 if there isn't any */
+unsigned long pram_first_free_block(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_alloc_group *ag;
+	unsigned long first = ULONG_MAX;
+	unsigned int i;
+
+	for (i = 0; i < sbi->s_groups_count && first == ULONG_MAX; i++) {
+		ag = &sbi->s_groups[i];
+		mutex_lock(&ag->lock);
+		first = pram_free_tree_first(&ag->free_tree);
+		mutex_unlock(&ag->lock);
+	}
+	return first == ULONG_MAX ? 0 : first;
+}
+
+/* Mark in use the block at offset off, if it's a valid data block */
+static void pram_mark_block(struct super_block *sb, unsigned long *bitmap,
+			    u64 off)
+{
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long blocknr;
+
+	if (off < be64_to_cpu(ps->s_bitmap_start))
+		goto bad;
+	blocknr = pram_get_blocknr(sb, off);
+	if (blocknr < be32_to_cpu(ps->s_bitmap_blocks) ||
+	    blocknr >= pram_blocks_count(ps))
+		goto bad;
+	pram_set_bit(blocknr, bitmap);
+	return;
+ bad:
+	pram_warn("bad block offset 0x%llx\n", off);
+}
+
+/*
+ * Mark in use the blocks under node, a block array at level: 0 for a
+ * column block, pointing to the data blocks, and up from there.
+ */
+static void pram_mark_array_blocks(struct super_block *sb,
+				   unsigned long *bitmap, u64 *node,
+				   unsigned int level)
+{
+	int N = sb->s_blocksize >> 3; /* num block ptrs per block */
+	int i;
+
+	for (i = 0; i < N; i++) {
+		if (!node[i])
+			continue;
+		pram_mark_block(sb, bitmap, be64_to_cpu(node[i]));
+		if (level)
+			pram_mark_array_blocks(sb, bitmap, pram_get_block(sb,
+					       be64_to_cpu(node[i])), level - 1);
+	}
+}
+
+/*
+ * Mark in use the blocks of a regular file or symlink: the row block,
+ * the column blocks and the data blocks with the index blocks above them
+ * if any, the extent tree nodes and the data blocks, or just the data
+ * blocks pointed by the inode.
+ */
+static void pram_mark_inode_blocks(struct super_block *sb,
+				   unsigned long *bitmap,
+				   struct pram_inode *pi)
+{
+	int i;
+
+	if (pram_has_inline_data(pi))
+		return;
+
+	if (pram_has_extents(pi)) {
+		pram_ext_for_each_block(sb, pi, pram_mark_block, bitmap);
+		return;
+	}
+
+	if (pram_has_direct(pi)) {
+		for (i = 0; i < PRAM_DIRECT_BLOCKS; i++)
+			if (pi->i_type.direct[i])
+				pram_mark_block(sb, bitmap,
+					be64_to_cpu(pi->i_type.direct[i]));
+		return;
+	}
+
+	if (!pi->i_type.reg.row_block)
+		return;
+
+	pram_mark_block(sb, bitmap, be64_to_cpu(pi->i_type.reg.row_block));
+	pram_mark_array_blocks(sb, bitmap, pram_get_block(sb,
+			       be64_to_cpu(pi->i_type.reg.row_block)),
+			       pram_tree_height(sb, pi) + 1);
+}
+
+/* Mark in use the blocks of the num inodes from pi */
+static void pram_mark_inodes(struct super_block *sb, unsigned long *bitmap,
+			     struct pram_inode *pi, unsigned long num)
+{
+	umode_t mode;
+
+	for (; num; num--, pi++) {
+		if (pram_inode_is_free(pi))
+			continue;
+		mode = be16_to_cpu(pi->i_mode);
+		if (S_ISREG(mode) || S_ISLNK(mode))
+			pram_mark_inode_blocks(sb, bitmap, pi);
+		if (pi->i_xattr)
+			pram_mark_block(sb, bitmap, be64_to_cpu(pi->i_xattr));
+		cond_resched();
+	}
+}
+
+/*
+ * After an unclean shutdown the bitmap can have blocks marked in use that
+ * nothing references, e.g. the ones that were cached in the per-CPU pools.
+ * Rebuild it from the inode table, the only reference of the blocks in use,
+ * and from the map of its chunks, which are data blocks themselves.
+ */
+void pram_rebuild_bitmap(struct super_block *sb)
+{
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long *bitmap = pram_get_bitmap(sb);
+	unsigned long size = be32_to_cpu(ps->s_bitmap_blocks) <<
+			     sb->s_blocksize_bits;
+	unsigned long chunk_size = PRAM_INODES_PER_CHUNK << PRAM_INODE_BITS;
+	unsigned int k, chunks = be32_to_cpu(ps->s_inode_chunks);
+	unsigned long off;
+	__be64 *map;
+
+	pram_memunlock_range_global(sb, bitmap, size);
+	pram_init_bitmap(sb);
+
+	pram_mark_inodes(sb, bitmap, pram_get_inode(sb, PRAM_ROOT_INO),
+			 be32_to_cpu(ps->s_inodes_count));
+
+	if (ps->s_inode_map && chunks <= (sb->s_blocksize >> 3)) {
+		pram_mark_block(sb, bitmap, be64_to_cpu(ps->s_inode_map));
+		map = pram_get_block(sb, be64_to_cpu(ps->s_inode_map));
+		for (k = 0; k < chunks; k++) {
+			for (off = 0; off < chunk_size; off += sb->s_blocksize)
+				pram_mark_block(sb, bitmap,
+						be64_to_cpu(map[k]) + off);
+			pram_mark_inodes(sb, bitmap, pram_get_inode(sb,
+					be64_to_cpu(map[k])),
+					PRAM_INODES_PER_CHUNK);
+		}
+	}
+
+	pram_memlock_range_global(sb, bitmap, size);
+}
+
+/*
+ * Take from the group ag a run of at most want free blocks, as close as
+ * possible to goal: the free run at or after goal if it's long enough,
+ * otherwise the lowest run long enough, otherwise the longest one. Called
+ * with the group lock held. It returns the length of the run, zero if the
+ * group is full.
+ */
+static unsigned long __pram_group_alloc(struct super_block *sb,
+					struct pram_alloc_group *ag,
+					unsigned long goal, unsigned long want,
+					unsigned long *start)
+{
+	struct rb_root *tree = &ag->free_tree;
+	unsigned long bnr, len, fit_bnr, fit_len;
+
+	len = pram_free_tree_near(tree, goal, &bnr);
+	if (len < want) {
+		fit_len = pram_free_tree_first_fit(tree, want, &fit_bnr);
+		if (!fit_len)
+			fit_len = pram_free_tree_first_fit(tree,
+					pram_free_tree_max_len(tree), &fit_bnr);
+		if (fit_len > len) {
+			len = fit_len;
+			bnr = fit_bnr;
+		}
+	}
+	if (!len)
+		return 0;
+
+	len = min(len, want);
+	pram_free_tree_remove(tree, bnr, len);
+	pram_bitmap_mark_run(sb, bnr, len, 1);
+	ag->free -= len;
+	ag->hint = bnr + len;
+	*start = bnr;
+	return len;
+}
+
+/*
+ * Claim a run of up to want free blocks, from the group of the current
+ * CPU first, then from the next ones. It returns the length of the run,
+ * zero if there isn't any free block.
+ */
+static unsigned long pram_claim_run(struct super_block *sb,
+				    unsigned long want, unsigned long *start)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned int i, g = pram_goal_group(sb, 0);
+	struct pram_alloc_group *ag;
+	unsigned long len = 0;
+
+	for (i = 0; i < sbi->s_groups_count && !len; i++) {
+		ag = &sbi->s_groups[(g + i) % sbi->s_groups_count];
+		if (!ACCESS_ONCE(ag->free))
+			continue;
+		mutex_lock(&ag->lock);
+		len = __pram_group_alloc(sb, ag, ag->hint, want, start);
+		mutex_unlock(&ag->lock);
+	}
+
+	if (!len) {
+		pram_dbg("no free blocks found!\n");
+		return 0;
+	}
+
+	pram_add_free_blocks(sb, -(long)len);
+	return len;
+}
+
+/*
+ * Give back the run of blocks [start, start + len) to the bitmap and to
+ * the free blocks trees of its groups. *locked is the group whose lock is
+ * held by the caller, if any, and it's switched as needed: consecutive
+ * runs of the same group take its lock only once.
+ */
+static void __pram_release_run(struct super_block *sb, unsigned long start,
+			       unsigned long len,
+			       struct pram_alloc_group **locked)
+{
+	struct pram_alloc_group *ag;
+	unsigned long n;
+
+	while (len) {
+		ag = pram_get_group(sb, start);
+		if (ag != *locked) {
+			if (*locked)
+				mutex_unlock(&(*locked)->lock);
+			mutex_lock(&ag->lock);
+			*locked = ag;
+		}
+		n = min(len, ag->end - start);
+		pram_bitmap_mark_run(sb, start, n, 0);
+		pram_free_tree_insert(&ag->free_tree, start, n);
+		ag->free += n;
+		start += n;
+		len -= n;
+	}
+}
+
+/* Give back the len blocks from start */
+static void pram_release_run(struct super_block *sb, unsigned long start,
+			     unsigned long len)
+{
+	struct pram_alloc_group *locked = NULL;
+
+	__pram_release_run(sb, start, len, &locked);
+	mutex_unlock(&locked->lock);
+	pram_add_free_blocks(sb, len);
+}
+
+/*
+ * Per-CPU block pools.
+ *
+ * Every CPU keeps a small stash of blocks already claimed in the bitmap,
+ * so the common allocation and free don't need the group locks at all. The pool
+ * lock is local to the CPU and it's taken by the other CPUs only when
+ * they drain the pools because the filesystem is running out of space.
+ * The bitmap is touched only for runs of up to PRAM_POOL_BATCH blocks,
+ * when a pool runs empty or overflows. The blocks move between the pools
+ * and the groups a run at a time, without being staged on the stack: the
+ * allocations can be deep in a metadata operation.
+ */
+int pram_init_blk_pools(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_blk_pool *pool;
+	int cpu;
+
+	sbi->s_pool = alloc_percpu(struct pram_blk_pool);
+	if (!sbi->s_pool)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(sbi->s_pool, cpu);
+		spin_lock_init(&pool->lock);
+		pool->count = 0;
+	}
+	return 0;
+}
+
+void pram_destroy_blk_pools(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	if (!sbi->s_pool)
+		return;
+	pram_drain_blk_pools(sb);
+	free_percpu(sbi->s_pool);
+	sbi->s_pool = NULL;
+}
+
+/*
+ * Take from the top of pool the run of consecutive blocks there, at most
+ * max long. It returns its length, zero if the pool is empty.
+ */
+static unsigned long pram_pool_pop_run(struct pram_blk_pool *pool,
+				       unsigned long max, unsigned long *start)
+{
+	unsigned long len = 0;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		*start = pool->blocks[--pool->count];
+		for (len = 1; len < max && pool->count &&
+		     pool->blocks[pool->count - 1] == *start + len; len++)
+			pool->count--;
+	}
+	spin_unlock(&pool->lock);
+	return len;
+}
+
+/*
+ * Give back to the bitmap up to want blocks of pool, a run at a time. It
+ * returns the number of blocks released.
+ */
+static unsigned long pram_pool_release(struct super_block *sb,
+				       struct pram_blk_pool *pool,
+				       unsigned long want)
+{
+	struct pram_alloc_group *locked = NULL;
+	unsigned long start, len, total = 0;
+
+	while (total < want &&
+	       (len = pram_pool_pop_run(pool, want - total, &start))) {
+		__pram_release_run(sb, start, len, &locked);
+		total += len;
+	}
+	if (locked)
+		mutex_unlock(&locked->lock);
+	if (total)
+		pram_add_free_blocks(sb, total);
+	return total;
+}
+
+/*
+ * Give back to the bitmap the blocks cached in every CPU pool.
+ * It returns the number of blocks released.
+ */
+unsigned long pram_drain_blk_pools(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long total = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		total += pram_pool_release(sb, per_cpu_ptr(sbi->s_pool, cpu),
+					   PRAM_POOL_SIZE);
+	return total;
+}
+
+/* Take a block from the pool of this CPU. It returns 0 if it's empty. */
+static int pram_pool_get(struct pram_sb_info *sbi, unsigned long *blocknr)
+{
+	struct pram_blk_pool *pool = get_cpu_ptr(sbi->s_pool);
+	int ret = 0;
+
+	spin_lock(&pool->lock);
+	if (pool->count) {
+		*blocknr = pool->blocks[--pool->count];
+		ret = 1;
+	}
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->s_pool);
+	return ret;
+}
+
+/*
+ * Stash in the pool of this CPU the blocks of the run [start, start + len),
+ * as many as fit. They are pushed in reverse order so that they are handed
+ * out in ascending order. It returns how many blocks were stashed.
+ */
+static unsigned long pram_pool_put_run(struct pram_sb_info *sbi,
+				       unsigned long start, unsigned long len)
+{
+	struct pram_blk_pool *pool = get_cpu_ptr(sbi->s_pool);
+	unsigned long i, n;
+
+	spin_lock(&pool->lock);
+	n = min_t(unsigned long, len, PRAM_POOL_SIZE - pool->count);
+	for (i = n; i--; )
+		pool->blocks[pool->count++] = start + i;
+	spin_unlock(&pool->lock);
+	put_cpu_ptr(sbi->s_pool);
+	return n;
+}
+
 /* Free absolute blocknr */
 void pram_free_block(struct super_block *sb, unsigned long blocknr)
 {
-	struct pram_super_block *ps;
-	u64 bitmap_block;
-	unsigned long bitmap_bnr;
-	void *bitmap;
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	/* the pool is full, give back a batch of it to the bitmap */
+	while (!pram_pool_put_run(sbi, blocknr, 1))
+		pram_pool_release(sb, per_cpu_ptr(sbi->s_pool,
+						  raw_smp_processor_id()),
+				  PRAM_POOL_BATCH);
+}
+
+/*
+ * Give back to the bitmap all the blocks of a batch, taking the lock of
+ * a group only once for consecutive runs in it. The runs are cleared in
+ * the bitmap a word at a time where possible.
+ */
+void pram_free_batch_flush(struct super_block *sb,
+			   struct pram_free_batch *batch)
+{
+	struct pram_alloc_group *locked = NULL;
+	unsigned int i;
+
+	if (!batch->nr)
+		return;
+
+	for (i = 0; i < batch->nr; i++)
+		__pram_release_run(sb, batch->run[i].start, batch->run[i].len,
+				   &locked);
+	mutex_unlock(&locked->lock);
+	pram_add_free_blocks(sb, batch->count);
+
+	pram_init_free_batch(batch);
+}
+
+/*
+ * Add absolute blocknr to a batch of blocks to free, extending the last
+ * run if it's contiguous. The batch is flushed when it's out of runs.
+ */
+void pram_free_batch_add(struct super_block *sb,
+			 struct pram_free_batch *batch, unsigned long blocknr)
+{
+	if (batch->nr) {
+		unsigned long start = batch->run[batch->nr - 1].start;
+		unsigned long len = batch->run[batch->nr - 1].len;
+
+		if (blocknr == start + len) {
+			batch->run[batch->nr - 1].len++;
+			goto out;
+		}
+		if (blocknr + 1 == start) {
+			batch->run[batch->nr - 1].start--;
+			batch->run[batch->nr - 1].len++;
+			goto out;
+		}
+	}
+
+	if (batch->nr == PRAM_FREE_BATCH)
+		pram_free_batch_flush(sb, batch);
+	batch->run[batch->nr].start = blocknr;
+	batch->run[batch->nr].len = 1;
+	batch->nr++;
+ out:
+	batch->count++;
+}
+
+/*
+ * Pre-zeroed blocks pool.
+ *
+ * Every new block of a file has to be zeroed, and doing it on the write
+ * path costs a full block memset. A kernel thread keeps a pool of runs of
+ * free blocks already zeroed, claimed in the bitmap as the blocks of the
+ * per-CPU pools. It refills the pool at low priority, with non-temporal
+ * stores, when it falls below half and only while there's plenty of free
+ * space. The allocations that want zeroed blocks draw from the pool first
+ * and zero synchronously only when it's empty.
+ */
+static inline int pram_zero_pool_low(struct pram_sb_info *sbi)
+{
+	return ACCESS_ONCE(sbi->s_zero_count) <
+		PRAM_ZERO_RUNS * PRAM_ZERO_RUN_LEN / 2;
+}
+
+/*
+ * Take from the pool up to want zeroed blocks. With a goal only the run
+ * starting there is taken, so that appends stay contiguous: otherwise
+ * the caller allocates near the goal and zeroes the blocks itself. It
+ * returns how many blocks were taken, zero if there wasn't a run.
+ */
+static unsigned long pram_zero_pool_get(struct super_block *sb,
+					unsigned long goal,
+					unsigned long want,
+					unsigned long *start)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_zero_pool *zp = sbi->s_zero_pool;
+	unsigned long n = 0;
+	unsigned int i;
+
+	if (!zp || !ACCESS_ONCE(sbi->s_zero_count))
+		return 0;
+
+	spin_lock(&zp->lock);
+	for (i = 0; i < zp->nr; i++)
+		if (!goal || zp->run[i].start == goal)
+			break;
+	if (i < zp->nr) {
+		n = min(want, zp->run[i].len);
+		*start = zp->run[i].start;
+		zp->run[i].start += n;
+		zp->run[i].len -= n;
+		if (!zp->run[i].len)
+			zp->run[i] = zp->run[--zp->nr];
+		sbi->s_zero_count -= n;
+	}
+	if (pram_zero_pool_low(sbi) && zp->thread)
+		wake_up_process(zp->thread);
+	spin_unlock(&zp->lock);
+	return n;
+}
+
+/*
+ * Give back to the bitmap the blocks of the pre-zeroed pool. It returns
+ * the number of blocks released.
+ */
+unsigned long pram_drain_zero_pool(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_zero_pool *zp = sbi->s_zero_pool;
+	struct pram_alloc_group *locked = NULL;
+	struct pram_zero_run run;
+	unsigned long count = 0;
+
+	if (!zp)
+		return 0;
+
+	/* a run at a time, the group lock can be held with the pool one */
+	for (;;) {
+		spin_lock(&zp->lock);
+		if (!zp->nr) {
+			spin_unlock(&zp->lock);
+			break;
+		}
+		run = zp->run[--zp->nr];
+		sbi->s_zero_count -= run.len;
+		spin_unlock(&zp->lock);
+
+		__pram_release_run(sb, run.start, run.len, &locked);
+		count += run.len;
+	}
+	if (locked)
+		mutex_unlock(&locked->lock);
+	if (count)
+		pram_add_free_blocks(sb, count);
+	return count;
+}
+
+/* Fill the pool up. It returns the number of blocks added. */
+static unsigned long pram_zero_pool_fill(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_zero_pool *zp = sbi->s_zero_pool;
+	unsigned long start, got, size, added = 0;
 	void *bp;
 
-	mutex_lock(&PRAM_SB(sb)->s_lock);
+	/* only this thread adds runs, so nr can only shrink under us */
+	while (!kthread_should_stop() && zp->nr < PRAM_ZERO_RUNS &&
+	       percpu_counter_read_positive(&sbi->s_freeblocks_counter) >
+	       PRAM_ZERO_RESERVE) {
+		/* don't touch a frozen fs */
+		if (!sb_start_write_trylock(sb))
+			break;
+		if (pram_new_blocks(sb, 0, PRAM_ZERO_RUN_LEN, &start, &got,
+				    0)) {
+			sb_end_write(sb);
+			break;
+		}
+		bp = pram_get_block(sb, pram_get_block_off(sb, start));
+		size = got << sb->s_blocksize_bits;
+		pram_zero_blocks(sb, bp, size);
+		sb_end_write(sb);
 
-	bitmap = pram_get_bitmap(sb);
-	/*
-	 * find the block within the bitmap that contains the inuse bit
-	 * for the block we need to free. We need to unlock this bitmap
-	 * block to clear the inuse bit.
-	 */
-	bitmap_bnr = blocknr >> (3 + sb->s_blocksize_bits);
-	bitmap_block = pram_get_block_off(sb, bitmap_bnr);
-	bp = pram_get_block(sb, bitmap_block);
+		spin_lock(&zp->lock);
+		zp->run[zp->nr].start = start;
+		zp->run[zp->nr].len = got;
+		zp->nr++;
+		sbi->s_zero_count += got;
+		spin_unlock(&zp->lock);
+
+		added += got;
+		cond_resched();
+	}
+	return added;
+}
+
+static int pram_zerod(void *data)
+{
+	struct super_block *sb = data;
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	/* zeroing is done at idle time */
+	set_user_nice(current, 19);
+
+	while (!kthread_should_stop()) {
+		/* set the state first not to miss a wake up of the getters */
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (pram_zero_pool_low(sbi)) {
+			__set_current_state(TASK_RUNNING);
+			if (pram_zero_pool_fill(sb))
+				continue;
+			/* no room or frozen, wait for the next allocation */
+			set_current_state(TASK_INTERRUPTIBLE);
+		}
+		if (!kthread_should_stop())
+			schedule();
+		__set_current_state(TASK_RUNNING);
+	}
+	return 0;
+}
 
-	pram_memunlock_block(sb, bp);
-	pram_clear_bit(blocknr, bitmap); /* mark the block free */
-	pram_memlock_block(sb, bp);
+int pram_start_zerod(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_zero_pool *zp;
+	struct task_struct *thread;
 
-	ps = pram_get_super(sb);
-	pram_memunlock_super(sb, ps);
+	zp = kzalloc(sizeof(*zp), GFP_KERNEL);
+	if (!zp)
+		return -ENOMEM;
+	spin_lock_init(&zp->lock);
+	sbi->s_zero_pool = zp;
 
-	if (blocknr < be32_to_cpu(ps->s_free_blocknr_hint))
-		ps->s_free_blocknr_hint = cpu_to_be32(blocknr);
-	be32_add_cpu(&ps->s_free_blocks_count, 1);
-	pram_memlock_super(sb, ps);
+	thread = kthread_run(pram_zerod, sb, "pram_zerod");
+	if (IS_ERR(thread)) {
+		sbi->s_zero_pool = NULL;
+		kfree(zp);
+		return PTR_ERR(thread);
+	}
 
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
+	spin_lock(&zp->lock);
+	zp->thread = thread;
+	spin_unlock(&zp->lock);
+	return 0;
 }
 
+/* Stop the thread and give back the pre-zeroed blocks */
+void pram_stop_zerod(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_zero_pool *zp = sbi->s_zero_pool;
+	struct task_struct *thread;
+
+	if (!zp)
+		return;
+
+	spin_lock(&zp->lock);
+	thread = zp->thread;
+	zp->thread = NULL;
+	spin_unlock(&zp->lock);
+	if (thread)
+		kthread_stop(thread);
+
+	pram_drain_zero_pool(sb);
+	sbi->s_zero_pool = NULL;
+	kfree(zp);
+}
 
 /*
  * allocate a block and return it's absolute blocknr. Zeroes out the
@@ -88,73 +942,343 @@ void pram_free_block(struct super_block *sb, unsigned long blocknr)
  */
 int pram_new_block(struct super_block *sb, unsigned long *blocknr, int zero)
 {
-	struct pram_super_block *ps;
-	u64 bitmap_block;
-	unsigned long bnr, bitmap_bnr;
-	int errval;
-	void *bitmap;
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long start, n, put;
 	void *bp;
 
-	mutex_lock(&PRAM_SB(sb)->s_lock);
-	ps = pram_get_super(sb);
-	bitmap = pram_get_bitmap(sb);
-
-	if (ps->s_free_blocks_count) {
-		/* find the oldest unused block */
-		bnr = pram_find_next_zero_bit(bitmap,
-					 be32_to_cpu(ps->s_blocks_count),
-					 be32_to_cpu(ps->s_free_blocknr_hint));
-
-		if (bnr < be32_to_cpu(ps->s_bitmap_blocks) ||
-				bnr >= be32_to_cpu(ps->s_blocks_count)) {
-			pram_dbg("no free blocks found!\n");
-			errval = -ENOSPC;
-			goto fail;
-		}
+	if (zero && pram_zero_pool_get(sb, 0, 1, blocknr)) {
+		zero = 0;
+		goto found;
+	}
 
-		pram_memunlock_super(sb, ps);
-		be32_add_cpu(&ps->s_free_blocks_count, -1);
-		if (bnr < (be32_to_cpu(ps->s_blocks_count)-1))
-			ps->s_free_blocknr_hint = cpu_to_be32(bnr+1);
-		else
-			ps->s_free_blocknr_hint = 0;
-		pram_memlock_super(sb, ps);
-	} else {
-		pram_dbg("all blocks allocated\n");
-		errval = -ENOSPC;
-		goto fail;
+	if (pram_pool_get(sbi, blocknr))
+		goto found;
+
+	/* The pool of this CPU is empty, refill it from the bitmap */
+	n = pram_claim_run(sb, PRAM_POOL_BATCH, &start);
+
+	if (!n && (pram_drain_blk_pools(sb) + pram_drain_zero_pool(sb) +
+		   pram_discard_all_prealloc(sb))) {
+		/* The last free blocks were cached or preallocated */
+		n = pram_claim_run(sb, PRAM_POOL_BATCH, &start);
 	}
 
-	/*
-	 * find the block within the bitmap that contains the inuse bit
-	 * for the unused block we just found. We need to unlock it to
-	 * set the inuse bit.
-	 */
-	bitmap_bnr = bnr >> (3 + sb->s_blocksize_bits);
-	bitmap_block = pram_get_block_off(sb, bitmap_bnr);
-	bp = pram_get_block(sb, bitmap_block);
+	if (!n) {
+		pram_dbg("all blocks allocated\n");
+		return -ENOSPC;
+	}
 
-	pram_memunlock_block(sb, bp);
-	pram_set_bit(bnr, bitmap); /* mark the new block in use */
-	pram_memlock_block(sb, bp);
+	*blocknr = start;
+	/* another task may have filled the pool meanwhile */
+	put = pram_pool_put_run(sbi, start + 1, n - 1);
+	if (put < n - 1)
+		pram_release_run(sb, start + 1 + put, n - 1 - put);
 
+ found:
 	if (zero) {
-		bp = pram_get_block(sb, pram_get_block_off(sb, bnr));
+		bp = pram_get_block(sb, pram_get_block_off(sb, *blocknr));
 		pram_memunlock_block(sb, bp);
-		memset(bp, 0, sb->s_blocksize);
+		pram_memzero(bp, sb->s_blocksize);
 		pram_memlock_block(sb, bp);
 	}
 
-	*blocknr = bnr;
-	pram_dbg("allocated blocknr %lu", bnr);
-	errval = 0;
- fail:
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
-	return errval;
+	pram_dbg("allocated blocknr %lu", *blocknr);
+	return 0;
 }
 
-unsigned long pram_count_free_blocks(struct super_block *sb)
+/*
+ * Allocate up to want physically contiguous blocks, as close as possible
+ * to the block goal (zero if there isn't any preference). The group of
+ * goal, or of the current CPU, is tried first. The first block of the
+ * run is returned in start and its length in got, which can be less than
+ * want if the free space is fragmented. Zeroes out the blocks if zero set.
+ */
+int pram_new_blocks(struct super_block *sb, unsigned long goal,
+		    unsigned long want, unsigned long *start,
+		    unsigned long *got, int zero)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned int i, g = pram_goal_group(sb, goal);
+	struct pram_alloc_group *ag;
+	unsigned long bnr, len = 0, size;
+	void *bp;
+	int errval;
+
+	if (!want)
+		return -EINVAL;
+
+	if (zero) {
+		len = pram_zero_pool_get(sb, goal, want, &bnr);
+		if (len) {
+			*start = bnr;
+			*got = len;
+			return 0;
+		}
+	}
+
+	for (i = 0; i < sbi->s_groups_count && !len; i++) {
+		ag = &sbi->s_groups[(g + i) % sbi->s_groups_count];
+		if (!ACCESS_ONCE(ag->free))
+			continue;
+		mutex_lock(&ag->lock);
+		len = __pram_group_alloc(sb, ag, (!i && goal) ? goal : ag->hint,
+					 want, &bnr);
+		mutex_unlock(&ag->lock);
+	}
+
+	if (!len) {
+		/* Maybe the other CPUs have cached the last free blocks */
+		errval = pram_new_block(sb, start, zero);
+		if (!errval)
+			*got = 1;
+		return errval;
+	}
+
+	pram_add_free_blocks(sb, -(long)len);
+
+	if (zero) {
+		bp = pram_get_block(sb, pram_get_block_off(sb, bnr));
+		size = len << sb->s_blocksize_bits;
+		pram_zero_blocks(sb, bp, size);
+	}
+
+	*start = bnr;
+	*got = len;
+	pram_dbg("allocated blocks %lu-%lu", bnr, bnr + len - 1);
+	return 0;
+}
+
+/*
+ * Allocate exactly want contiguous blocks, the first one plus off being a
+ * multiple of align, near the block goal, and zero them. Every group is
+ * scanned, the zero pool and the shorter runs are skipped. Returns -ENOSPC
+ * if there isn't such a run, even if there are free blocks.
+ */
+static int pram_new_run_aligned(struct super_block *sb, unsigned long goal,
+				unsigned long want, unsigned long align,
+				unsigned long off, unsigned long *start)
 {
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned int i, g = pram_goal_group(sb, goal);
+	struct pram_alloc_group *ag;
+	unsigned long bnr, size;
+	int found = 0;
+	void *bp;
+
+	for (i = 0; i < sbi->s_groups_count && !found; i++) {
+		ag = &sbi->s_groups[(g + i) % sbi->s_groups_count];
+		if (ACCESS_ONCE(ag->free) < want)
+			continue;
+		mutex_lock(&ag->lock);
+		found = pram_free_tree_aligned_fit(&ag->free_tree, want, align,
+						   off, &bnr);
+		if (found) {
+			pram_free_tree_remove(&ag->free_tree, bnr, want);
+			pram_bitmap_mark_run(sb, bnr, want, 1);
+			ag->free -= want;
+			ag->hint = bnr + want;
+		}
+		mutex_unlock(&ag->lock);
+	}
+
+	if (!found)
+		return -ENOSPC;
+
+	pram_add_free_blocks(sb, -(long)want);
+
+	bp = pram_get_block(sb, pram_get_block_off(sb, bnr));
+	size = want << sb->s_blocksize_bits;
+	pram_zero_blocks(sb, bp, size);
+
+	*start = bnr;
+	pram_dbg("allocated blocks %lu-%lu", bnr, bnr + want - 1);
+	return 0;
+}
+
+/*
+ * Allocate exactly want physically contiguous zeroed blocks near goal, or
+ * none, e.g. for a chunk of the inode table.
+ */
+int pram_new_blocks_exact(struct super_block *sb, unsigned long goal,
+			  unsigned long want, unsigned long *start)
+{
+	return pram_new_run_aligned(sb, goal, want, 1, 0, start);
+}
+
+/*
+ * Allocate pram_huge_blocks() physically contiguous blocks whose physical
+ * address is aligned to the huge page size, near the block goal. They're
+ * always zeroed, being mapped straight to userspace by xip. Returns
+ * -ENOSPC if there isn't any aligned run, even if there are free blocks.
+ */
+int pram_new_huge_blocks(struct super_block *sb, unsigned long goal,
+			 unsigned long *start)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
 	struct pram_super_block *ps = pram_get_super(sb);
-	return be32_to_cpu(ps->s_free_blocks_count);
+	unsigned long want = pram_huge_blocks(sb);
+	unsigned long off;
+
+	/* misalignment, in blocks, of the physical address of block 0 */
+	off = ((sbi->phys_addr + be64_to_cpu(ps->s_bitmap_start)) >>
+	       sb->s_blocksize_bits) & (want - 1);
+
+	return pram_new_run_aligned(sb, goal, want, want, off, start);
+}
+
+/*
+ * Preallocation windows.
+ *
+ * A file growing by small appends would get one allocation per block and
+ * its blocks interleaved with the ones of the other files growing at the
+ * same time. Instead, an append beyond the window of the file allocates
+ * a longer run and the blocks after the ones needed are kept in the
+ * window, reserved for the next appends. Windows are released by the last
+ * close of the file, when the inode is evicted or truncated and when the
+ * filesystem is running out of space. Windows lost in a crash are found
+ * by the bitmap rebuild at the next mount.
+ */
+
+/*
+ * Take up to want blocks for the file block iblock from the window of
+ * inode. The window is used only if it starts at iblock, so the file
+ * stays contiguous. Returns the number of blocks taken, the first one in
+ * start.
+ */
+unsigned long pram_prealloc_take(struct inode *inode, unsigned long iblock,
+				 unsigned long want, unsigned long *start)
+{
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+	unsigned long got = 0;
+
+	spin_lock(&vi->i_prealloc_lock);
+	if (vi->i_prealloc_len && vi->i_prealloc_iblock == iblock) {
+		got = min(want, vi->i_prealloc_len);
+		*start = vi->i_prealloc_start;
+		vi->i_prealloc_iblock += got;
+		vi->i_prealloc_start += got;
+		vi->i_prealloc_len -= got;
+	}
+	spin_unlock(&vi->i_prealloc_lock);
+
+	if (got)
+		atomic_long_sub(got, &PRAM_SB(inode->i_sb)->s_prealloc_count);
+	return got;
+}
+
+/*
+ * Set the window of inode to the len blocks from start, for the file
+ * blocks from iblock. Any previous window is released.
+ */
+void pram_prealloc_set(struct inode *inode, unsigned long iblock,
+		       unsigned long start, unsigned long len)
+{
+	struct pram_sb_info *sbi = PRAM_SB(inode->i_sb);
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+	unsigned long old_start, old_len;
+
+	atomic_long_add(len, &sbi->s_prealloc_count);
+
+	spin_lock(&sbi->s_prealloc_lock);
+	spin_lock(&vi->i_prealloc_lock);
+	old_start = vi->i_prealloc_start;
+	old_len = vi->i_prealloc_len;
+	vi->i_prealloc_iblock = iblock;
+	vi->i_prealloc_start = start;
+	vi->i_prealloc_len = len;
+	if (list_empty(&vi->i_prealloc_list))
+		list_add_tail(&vi->i_prealloc_list, &sbi->s_prealloc_list);
+	spin_unlock(&vi->i_prealloc_lock);
+	spin_unlock(&sbi->s_prealloc_lock);
+
+	if (old_len) {
+		atomic_long_sub(old_len, &sbi->s_prealloc_count);
+		pram_release_run(inode->i_sb, old_start, old_len);
+	}
+}
+
+/*
+ * Unlink vi from the list of the inodes with a window and empty it. It
+ * returns the length of the window, the first block in start. Called with
+ * s_prealloc_lock held.
+ */
+static unsigned long __pram_detach_prealloc(struct pram_sb_info *sbi,
+					    struct pram_inode_vfs *vi,
+					    unsigned long *start)
+{
+	unsigned long len;
+
+	spin_lock(&vi->i_prealloc_lock);
+	*start = vi->i_prealloc_start;
+	len = vi->i_prealloc_len;
+	vi->i_prealloc_len = 0;
+	list_del_init(&vi->i_prealloc_list);
+	spin_unlock(&vi->i_prealloc_lock);
+
+	if (len)
+		atomic_long_sub(len, &sbi->s_prealloc_count);
+	return len;
+}
+
+/* Release the window of inode, if any */
+void pram_discard_prealloc(struct inode *inode)
+{
+	struct pram_sb_info *sbi = PRAM_SB(inode->i_sb);
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+	unsigned long start, len;
+
+	if (list_empty(&vi->i_prealloc_list))
+		return;
+
+	spin_lock(&sbi->s_prealloc_lock);
+	len = __pram_detach_prealloc(sbi, vi, &start);
+	spin_unlock(&sbi->s_prealloc_lock);
+
+	if (len)
+		pram_release_run(inode->i_sb, start, len);
+}
+
+/*
+ * Release the windows of all inodes. Returns the number of blocks
+ * released.
+ */
+unsigned long pram_discard_all_prealloc(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_inode_vfs *vi;
+	unsigned long start, len, count = 0;
+
+	for (;;) {
+		spin_lock(&sbi->s_prealloc_lock);
+		if (list_empty(&sbi->s_prealloc_list)) {
+			spin_unlock(&sbi->s_prealloc_lock);
+			break;
+		}
+		vi = list_first_entry(&sbi->s_prealloc_list,
+				      struct pram_inode_vfs, i_prealloc_list);
+		len = __pram_detach_prealloc(sbi, vi, &start);
+		spin_unlock(&sbi->s_prealloc_lock);
+
+		if (len)
+			pram_release_run(sb, start, len);
+		count += len;
+	}
+	return count;
+}
+
+unsigned long pram_count_free_blocks(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long count;
+	int cpu;
+
+	count = percpu_counter_sum_positive(&sbi->s_freeblocks_counter);
+
+	/* The blocks cached in the pools are free as well */
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(sbi->s_pool, cpu)->count;
+	count += ACCESS_ONCE(sbi->s_zero_count);
+	/* and so are the ones in the preallocation windows */
+	count += atomic_long_read(&sbi->s_prealloc_count);
+	return count;
 }
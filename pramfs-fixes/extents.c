@@ -0,0 +1,682 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Extent tree block mapping.
+ *
+ * With the extents feature the data blocks of a regular file are mapped
+ * by extents instead of the two-level block arrays: a run of blocks
+ * contiguous both in the file and on the media takes a single record,
+ * whatever its length. The records are kept in a B+tree rooted in the
+ * inode, see pram_fs_uapi.h for the layout.
+ *
+ * As for the block arrays, the lookups don't take any lock. They retry
+ * if i_ext_seq changed while they were walking the tree, and check every
+ * node before to trust it, because it could have been freed and reused
+ * in the meantime. The updates are serialized by i_ext_mutex: they get
+ * the new nodes before to start and change the tree in a write section
+ * of i_ext_seq, where they never sleep.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/fs.h>
+#include "pram.h"
+#include "extents.h"
+
+/* A walk from the root to a leaf of the tree */
+struct pram_ext_path {
+	int depth;	/* depth of the tree, -1 if the root is in the inode */
+	struct {
+		struct pram_extent_header *eh;
+		int pos;	/* current record */
+	} lv[PRAM_EXT_MAX_DEPTH + 1];
+};
+
+/* Leaf and index records have the same size and first field */
+static inline struct pram_extent *ext_rec(struct pram_extent_header *eh,
+					  int i)
+{
+	return (struct pram_extent *)(eh + 1) + i;
+}
+
+static inline struct pram_extent_idx *ext_idx(struct pram_extent_header *eh,
+					      int i)
+{
+	return (struct pram_extent_idx *)(eh + 1) + i;
+}
+
+static inline int ext_max(struct super_block *sb)
+{
+	return (sb->s_blocksize / sizeof(struct pram_extent)) - 1;
+}
+
+/* Number of records of eh, never beyond the node even if it's garbage */
+static inline int ext_entries(struct super_block *sb,
+			      struct pram_extent_header *eh)
+{
+	return min_t(int, be16_to_cpu(ACCESS_ONCE(eh->eh_entries)),
+		     ext_max(sb));
+}
+
+static inline unsigned long ext_blocknr(struct super_block *sb,
+					struct pram_extent_header *eh)
+{
+	return pram_get_blocknr(sb, (void *)eh - (void *)pram_get_super(sb));
+}
+
+static void ext_to_cpu(struct super_block *sb, struct pram_extent *ex,
+		       struct pram_ext *ext)
+{
+	ext->lblk = be32_to_cpu(ex->ee_block);
+	ext->len = be32_to_cpu(ex->ee_len);
+	ext->pblk = pram_get_blocknr(sb, be64_to_cpu(ex->ee_start));
+}
+
+static void ext_to_media(struct super_block *sb, struct pram_ext *ext,
+			 struct pram_extent *ex)
+{
+	ex->ee_block = cpu_to_be32(ext->lblk);
+	ex->ee_len = cpu_to_be32(ext->len);
+	ex->ee_start = cpu_to_be64(pram_get_block_off(sb, ext->pblk));
+}
+
+/*
+ * Get the node at offset off, expected at the given depth or at any depth
+ * if it's negative (the root).
+ */
+static struct pram_extent_header *pram_ext_node(struct super_block *sb,
+						u64 off, int depth)
+{
+	struct pram_super_block *ps = pram_get_super(sb);
+	struct pram_extent_header *eh;
+	int d;
+
+	if (off < be64_to_cpu(ps->s_bitmap_start) ||
+	    off + sb->s_blocksize > be64_to_cpu(ps->s_size) ||
+	    off & (sb->s_blocksize - 1))
+		return NULL;
+
+	eh = pram_get_block(sb, off);
+	d = be16_to_cpu(eh->eh_depth);
+	if (eh->eh_magic != cpu_to_be16(PRAM_EXTENT_MAGIC) ||
+	    d > PRAM_EXT_MAX_DEPTH || (depth >= 0 && d != depth) ||
+	    be16_to_cpu(eh->eh_entries) > ext_max(sb))
+		return NULL;
+	return eh;
+}
+
+/* Index of the last of the n records of eh starting at or before lblk */
+static int pram_ext_search(struct pram_extent_header *eh, int n,
+			   unsigned long lblk)
+{
+	int lo = 0, hi = n - 1, mid, pos = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (be32_to_cpu(ext_rec(eh, mid)->ee_block) <= lblk) {
+			pos = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return pos;
+}
+
+/*
+ * Walk down the tree of pi to the leaf that should hold lblk. In the leaf
+ * the current record is the last one starting at or before lblk, -1 if
+ * there isn't any. It returns -EIO on a bad node.
+ */
+static int pram_ext_get_path(struct super_block *sb, struct pram_inode *pi,
+			     unsigned long lblk, struct pram_ext_path *path)
+{
+	struct pram_extent *root = &pi->i_type.ext;
+	struct pram_extent_header *eh;
+	int level, n, pos;
+	u64 off;
+
+	off = be64_to_cpu(ACCESS_ONCE(root->ee_start));
+	if (!off || root->ee_len) {
+		path->depth = -1;
+		return 0;
+	}
+
+	eh = pram_ext_node(sb, off, -1);
+	if (!eh)
+		return -EIO;
+	path->depth = be16_to_cpu(eh->eh_depth);
+
+	for (level = 0; ; level++) {
+		n = ext_entries(sb, eh);
+		pos = pram_ext_search(eh, n, lblk);
+		path->lv[level].eh = eh;
+		path->lv[level].pos = pos;
+		if (level == path->depth)
+			return 0;
+
+		/* only the leftmost subtree can hold blocks below its key */
+		if (!n)
+			return -EIO;
+		if (pos < 0)
+			path->lv[level].pos = pos = 0;
+		off = be64_to_cpu(ext_idx(eh, pos)->ei_child);
+		eh = pram_ext_node(sb, off, path->depth - level - 1);
+		if (!eh)
+			return -EIO;
+	}
+}
+
+/* Move path to the first record of the next leaf, if any */
+static int pram_ext_next_leaf(struct super_block *sb,
+			      struct pram_ext_path *path)
+{
+	struct pram_extent_header *eh;
+	int level = path->depth;
+	u64 off;
+
+	do {
+		if (--level < 0)
+			return 0;
+		eh = path->lv[level].eh;
+	} while (path->lv[level].pos + 1 >= ext_entries(sb, eh));
+
+	path->lv[level].pos++;
+	for (; level < path->depth; level++) {
+		eh = path->lv[level].eh;
+		off = be64_to_cpu(ext_idx(eh, path->lv[level].pos)->ei_child);
+		eh = pram_ext_node(sb, off, path->depth - level - 1);
+		if (!eh || !ext_entries(sb, eh))
+			return 0;
+		path->lv[level + 1].eh = eh;
+		path->lv[level + 1].pos = 0;
+	}
+	return 1;
+}
+
+/* pram_ext_find()
+ *
+ * Find the extent of pi containing lblk, or the first one after it. It
+ * returns 1 if there's one. Without i_ext_mutex, the caller must check
+ * i_ext_seq before to use the result.
+ */
+int pram_ext_find(struct super_block *sb, struct pram_inode *pi,
+		  unsigned long lblk, struct pram_ext *ext)
+{
+	struct pram_ext_path path;
+	struct pram_extent_header *eh;
+	int pos;
+
+	if (pram_ext_get_path(sb, pi, lblk, &path))
+		return 0;
+
+	if (path.depth < 0) {
+		if (!pi->i_type.ext.ee_len)
+			return 0;
+		ext_to_cpu(sb, &pi->i_type.ext, ext);
+		return ext->lblk + ext->len > lblk;
+	}
+
+	eh = path.lv[path.depth].eh;
+	pos = path.lv[path.depth].pos;
+	if (pos >= 0) {
+		ext_to_cpu(sb, ext_rec(eh, pos), ext);
+		if (ext->lblk + ext->len > lblk)
+			return 1;
+	}
+
+	/* lblk is in a hole, get the next extent */
+	if (++pos >= ext_entries(sb, eh)) {
+		if (!pram_ext_next_leaf(sb, &path))
+			return 0;
+		eh = path.lv[path.depth].eh;
+		pos = 0;
+	}
+	ext_to_cpu(sb, ext_rec(eh, pos), ext);
+	return 1;
+}
+
+static void pram_ext_set_root(struct super_block *sb, struct pram_inode *pi,
+			      struct pram_extent *root)
+{
+	pram_memunlock_inode(sb, pi);
+	pi->i_type.ext = *root;
+	pram_memlock_inode(sb, pi);
+}
+
+static struct pram_extent_header *pram_ext_new_node(struct super_block *sb,
+						    unsigned long blocknr,
+						    int depth)
+{
+	struct pram_extent_header *eh;
+
+	eh = pram_get_block(sb, pram_get_block_off(sb, blocknr));
+	pram_memunlock_block(sb, eh);
+	eh->eh_magic = cpu_to_be16(PRAM_EXTENT_MAGIC);
+	eh->eh_entries = 0;
+	eh->eh_max = cpu_to_be16(ext_max(sb));
+	eh->eh_depth = cpu_to_be16(depth);
+	eh->eh_reserved = 0;
+	pram_memlock_block(sb, eh);
+	return eh;
+}
+
+/* Insert the record rec at pos of the node eh, that must have room */
+static void pram_ext_insert_rec(struct pram_extent_header *eh, int pos,
+				void *rec)
+{
+	int n = be16_to_cpu(eh->eh_entries);
+
+	memmove(ext_rec(eh, pos + 1), ext_rec(eh, pos),
+		(n - pos) * sizeof(struct pram_extent));
+	memcpy(ext_rec(eh, pos), rec, sizeof(struct pram_extent));
+	eh->eh_entries = cpu_to_be16(n + 1);
+}
+
+/* Can ext be appended to the extent ex? */
+static int pram_ext_mergeable(struct super_block *sb, struct pram_extent *ex,
+			      struct pram_ext *ext)
+{
+	unsigned long len = be32_to_cpu(ex->ee_len);
+
+	return be32_to_cpu(ex->ee_block) + len == ext->lblk &&
+		pram_get_blocknr(sb, be64_to_cpu(ex->ee_start)) + len ==
+		ext->pblk && len + ext->len <= PRAM_EXT_MAX_LEN;
+}
+
+/*
+ * Insert rec in the leaf of path, right after the current record, and
+ * split the full nodes bottom up. nodes are the blocks for the new ones.
+ */
+static void pram_ext_insert_path(struct super_block *sb,
+				 struct pram_inode *pi,
+				 struct pram_ext_path *path,
+				 struct pram_extent *rec, unsigned long *nodes)
+{
+	struct pram_extent_header *eh, *neh;
+	struct pram_extent_idx idx[2];
+	struct pram_extent root = { 0 };
+	union {
+		struct pram_extent ex;
+		struct pram_extent_idx idx;
+	} r;
+	int level, pos, n, split, k = 0;
+
+	r.ex = *rec;
+	for (level = path->depth; level >= 0; level--) {
+		eh = path->lv[level].eh;
+		pos = path->lv[level].pos + 1;
+		n = be16_to_cpu(eh->eh_entries);
+
+		pram_memunlock_block(sb, eh);
+		if (n < ext_max(sb)) {
+			pram_ext_insert_rec(eh, pos, &r);
+			pram_memlock_block(sb, eh);
+			return;
+		}
+
+		/*
+		 * Split the node. An append goes alone in the new node, so
+		 * that a file written sequentially gets full nodes.
+		 */
+		split = pos == n ? n : n / 2;
+		neh = pram_ext_new_node(sb, nodes[k], path->depth - level);
+		pram_memunlock_block(sb, neh);
+		memcpy(ext_rec(neh, 0), ext_rec(eh, split),
+		       (n - split) * sizeof(struct pram_extent));
+		neh->eh_entries = cpu_to_be16(n - split);
+		eh->eh_entries = cpu_to_be16(split);
+		if (pos < split)
+			pram_ext_insert_rec(eh, pos, &r);
+		else
+			pram_ext_insert_rec(neh, pos - split, &r);
+		pram_memlock_block(sb, neh);
+		pram_memlock_block(sb, eh);
+
+		/* and link it in the parent */
+		r.idx.ei_block = ext_rec(neh, 0)->ee_block;
+		r.idx.ei_unused = 0;
+		r.idx.ei_child = cpu_to_be64(pram_get_block_off(sb, nodes[k]));
+		k++;
+	}
+
+	/* the root has been split, the tree grows by a level */
+	eh = path->lv[0].eh;
+	idx[0].ei_block = ext_rec(eh, 0)->ee_block;
+	idx[0].ei_unused = 0;
+	idx[0].ei_child = pi->i_type.ext.ee_start;
+	idx[1] = r.idx;
+
+	eh = pram_ext_new_node(sb, nodes[k], path->depth + 1);
+	pram_memunlock_block(sb, eh);
+	memcpy(ext_idx(eh, 0), idx, sizeof(idx));
+	eh->eh_entries = cpu_to_be16(2);
+	pram_memlock_block(sb, eh);
+
+	root.ee_start = cpu_to_be64(pram_get_block_off(sb, nodes[k]));
+	pram_ext_set_root(sb, pi, &root);
+}
+
+/* pram_ext_insert()
+ *
+ * Map the extent ext in the tree of inode. Its file blocks must be a
+ * hole. The caller holds i_ext_mutex.
+ */
+int pram_ext_insert(struct inode *inode, struct pram_ext *ext)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	struct pram_extent *ex = &pi->i_type.ext, rec, root = { 0 };
+	struct pram_extent_header *eh = NULL;
+	struct pram_ext_path path;
+	unsigned long nodes[PRAM_EXT_MAX_DEPTH + 2];
+	int level, need = 0, errval, i;
+
+	BUILD_BUG_ON(sizeof(struct pram_extent) !=
+		     sizeof(struct pram_extent_idx));
+	BUILD_BUG_ON(sizeof(struct pram_extent) !=
+		     sizeof(struct pram_extent_header));
+
+	ext_to_media(sb, ext, &rec);
+
+	if (!ex->ee_start) {
+		write_seqcount_begin(seq);
+		pram_ext_set_root(sb, pi, &rec);
+		write_seqcount_end(seq);
+		return 0;
+	}
+
+	errval = pram_ext_get_path(sb, pi, ext->lblk, &path);
+	if (errval)
+		return errval;
+
+	if (path.depth >= 0) {
+		eh = path.lv[path.depth].eh;
+		i = path.lv[path.depth].pos;
+		ex = i >= 0 ? ext_rec(eh, i) : NULL;
+	}
+
+	/* the common case, an append right after the previous extent */
+	if (ex && pram_ext_mergeable(sb, ex, ext)) {
+		write_seqcount_begin(seq);
+		if (eh)
+			pram_memunlock_block(sb, eh);
+		else
+			pram_memunlock_inode(sb, pi);
+		ex->ee_len = cpu_to_be32(be32_to_cpu(ex->ee_len) + ext->len);
+		if (eh)
+			pram_memlock_block(sb, eh);
+		else
+			pram_memlock_inode(sb, pi);
+		write_seqcount_end(seq);
+		return 0;
+	}
+
+	/* count the nodes to split, and the new root */
+	if (path.depth < 0) {
+		need = 1;
+	} else {
+		for (level = path.depth; level >= 0 &&
+		     ext_entries(sb, path.lv[level].eh) == ext_max(sb); level--)
+			need++;
+		if (level < 0) {
+			if (path.depth == PRAM_EXT_MAX_DEPTH)
+				return -EFBIG;
+			need++;
+		}
+	}
+
+	for (i = 0; i < need; i++) {
+		errval = pram_new_block(sb, &nodes[i], 0);
+		if (errval) {
+			while (i--)
+				pram_free_block(sb, nodes[i]);
+			return errval;
+		}
+	}
+
+	write_seqcount_begin(seq);
+	if (path.depth >= 0) {
+		pram_ext_insert_path(sb, pi, &path, &rec, nodes);
+	} else {
+		/* a second extent, move them to a leaf */
+		eh = pram_ext_new_node(sb, nodes[0], 0);
+		pram_memunlock_block(sb, eh);
+		if (ext->lblk > be32_to_cpu(ex->ee_block)) {
+			*ext_rec(eh, 0) = *ex;
+			*ext_rec(eh, 1) = rec;
+		} else {
+			*ext_rec(eh, 0) = rec;
+			*ext_rec(eh, 1) = *ex;
+		}
+		eh->eh_entries = cpu_to_be16(2);
+		pram_memlock_block(sb, eh);
+		root.ee_start = cpu_to_be64(pram_get_block_off(sb, nodes[0]));
+		pram_ext_set_root(sb, pi, &root);
+	}
+	write_seqcount_end(seq);
+	return 0;
+}
+
+/*
+ * Delete the current record of the leaf of path. The nodes left empty are
+ * unlinked from their parents, then the root is replaced by its only
+ * record while it has one. The blocks of the nodes dropped are returned in
+ * freed, and their number.
+ */
+static int pram_ext_delete_path(struct super_block *sb, struct pram_inode *pi,
+				struct pram_ext_path *path,
+				unsigned long *freed)
+{
+	struct pram_extent_header *eh;
+	struct pram_extent root;
+	int level, depth, pos, n, k = 0;
+
+	for (level = path->depth; level >= 0; level--) {
+		eh = path->lv[level].eh;
+		pos = path->lv[level].pos;
+		n = be16_to_cpu(eh->eh_entries);
+		if (n == 1 && level) {
+			freed[k++] = ext_blocknr(sb, eh);
+			continue;
+		}
+		pram_memunlock_block(sb, eh);
+		memmove(ext_rec(eh, pos), ext_rec(eh, pos + 1),
+			(n - pos - 1) * sizeof(struct pram_extent));
+		eh->eh_entries = cpu_to_be16(n - 1);
+		pram_memlock_block(sb, eh);
+		break;
+	}
+
+	eh = path->lv[0].eh;
+	depth = path->depth;
+	root = pi->i_type.ext;
+	while ((n = be16_to_cpu(eh->eh_entries)) <= 1) {
+		freed[k++] = ext_blocknr(sb, eh);
+		if (!n) {
+			memset(&root, 0, sizeof(root));
+			break;
+		}
+		if (!depth) {
+			/* a single extent goes back in the inode */
+			root = *ext_rec(eh, 0);
+			break;
+		}
+		root.ee_start = ext_idx(eh, 0)->ei_child;
+		eh = pram_get_block(sb, be64_to_cpu(root.ee_start));
+		depth--;
+	}
+
+	if (memcmp(&root, &pi->i_type.ext, sizeof(root)))
+		pram_ext_set_root(sb, pi, &root);
+	return k;
+}
+
+static void pram_ext_set_rec(struct super_block *sb, struct pram_inode *pi,
+			     struct pram_ext_path *path, struct pram_ext *ext)
+{
+	struct pram_extent_header *eh;
+
+	if (path->depth < 0) {
+		pram_memunlock_inode(sb, pi);
+		ext_to_media(sb, ext, &pi->i_type.ext);
+		pram_memlock_inode(sb, pi);
+		return;
+	}
+
+	eh = path->lv[path->depth].eh;
+	pram_memunlock_block(sb, eh);
+	ext_to_media(sb, ext, ext_rec(eh, path->lv[path->depth].pos));
+	pram_memlock_block(sb, eh);
+}
+
+/* pram_ext_remove()
+ *
+ * Unmap the file blocks from first to last of inode, adding the data
+ * blocks and the nodes freed to batch. The extents are trimmed from the
+ * last one, so that a truncate only drops records at the end of the
+ * leaves. It returns the number of data blocks freed. The caller holds
+ * i_ext_mutex.
+ */
+unsigned long pram_ext_remove(struct inode *inode, unsigned long first,
+			      unsigned long last, struct pram_free_batch *batch)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned long nodes[2 * (PRAM_EXT_MAX_DEPTH + 1)];
+	unsigned long freed = 0, start, end, blocknr, b;
+	struct pram_extent none = { 0 };
+	struct pram_ext_path path;
+	struct pram_ext ext, tail;
+	int i, pos, k, punch;
+
+	while (pi->i_type.ext.ee_start) {
+		if (pram_ext_get_path(sb, pi, last, &path)) {
+			pram_err(sb, "bad extent tree in inode %lu\n",
+				 inode->i_ino);
+			break;
+		}
+
+		/* the last extent starting at or before last */
+		if (path.depth < 0) {
+			ext_to_cpu(sb, &pi->i_type.ext, &ext);
+		} else {
+			pos = path.lv[path.depth].pos;
+			if (pos < 0)
+				break;
+			ext_to_cpu(sb, ext_rec(path.lv[path.depth].eh, pos),
+				   &ext);
+		}
+		/* the root extent is taken even if it starts after last */
+		if (ext.lblk + ext.len <= first || ext.lblk > last)
+			break;
+
+		start = max(ext.lblk, first);
+		end = min(ext.lblk + ext.len - 1, last);
+		blocknr = ext.pblk + start - ext.lblk;
+		punch = start > ext.lblk && end < ext.lblk + ext.len - 1;
+		tail.lblk = end + 1;
+		tail.pblk = ext.pblk + tail.lblk - ext.lblk;
+		tail.len = ext.lblk + ext.len - tail.lblk;
+		k = 0;
+
+		write_seqcount_begin(seq);
+		if (start > ext.lblk) {
+			ext.len = start - ext.lblk;
+			pram_ext_set_rec(sb, pi, &path, &ext);
+		} else if (tail.len) {
+			pram_ext_set_rec(sb, pi, &path, &tail);
+		} else if (path.depth < 0) {
+			pram_ext_set_root(sb, pi, &none);
+		} else {
+			k = pram_ext_delete_path(sb, pi, &path, nodes);
+		}
+		write_seqcount_end(seq);
+
+		for (b = blocknr; b <= blocknr + end - start; b++)
+			pram_free_batch_add(sb, batch, b);
+		for (i = 0; i < k; i++)
+			pram_free_batch_add(sb, batch, nodes[i]);
+		freed += end - start + 1;
+
+		/* a hole in the middle of the extent, map what's after it */
+		if (punch && pram_ext_insert(inode, &tail)) {
+			pram_warn("no space to split an extent of inode %lu, "
+				  "%lu blocks dropped\n", inode->i_ino,
+				  tail.len);
+			for (b = tail.pblk; b < tail.pblk + tail.len; b++)
+				pram_free_batch_add(sb, batch, b);
+			freed += tail.len;
+		}
+		cond_resched();
+	}
+
+	return freed;
+}
+
+static void pram_ext_walk_node(struct super_block *sb, u64 off, int depth,
+			       void (*fn)(struct super_block *sb,
+					  unsigned long *bitmap, u64 off),
+			       unsigned long *bitmap)
+{
+	struct pram_extent_header *eh = pram_ext_node(sb, off, depth);
+	struct pram_extent *ex;
+	unsigned long len;
+	int i;
+
+	if (!eh) {
+		pram_warn("bad extent node 0x%llx\n", off);
+		return;
+	}
+
+	fn(sb, bitmap, off);
+	depth = be16_to_cpu(eh->eh_depth);
+	for (i = 0; i < ext_entries(sb, eh); i++) {
+		if (depth) {
+			pram_ext_walk_node(sb,
+					   be64_to_cpu(ext_idx(eh, i)->ei_child),
+					   depth - 1, fn, bitmap);
+			continue;
+		}
+		ex = ext_rec(eh, i);
+		off = be64_to_cpu(ex->ee_start);
+		for (len = be32_to_cpu(ex->ee_len); len; len--) {
+			fn(sb, bitmap, off);
+			off += sb->s_blocksize;
+		}
+	}
+}
+
+/* pram_ext_for_each_block()
+ *
+ * Call fn on the offset of every block of the tree of pi, both nodes and
+ * data blocks. The tree must not change meanwhile.
+ */
+void pram_ext_for_each_block(struct super_block *sb, struct pram_inode *pi,
+			     void (*fn)(struct super_block *sb,
+					unsigned long *bitmap, u64 off),
+			     unsigned long *bitmap)
+{
+	struct pram_extent *root = &pi->i_type.ext;
+	unsigned long len;
+	u64 off;
+
+	if (!root->ee_start)
+		return;
+
+	if (!root->ee_len) {
+		pram_ext_walk_node(sb, be64_to_cpu(root->ee_start), -1, fn,
+				   bitmap);
+		return;
+	}
+
+	off = be64_to_cpu(root->ee_start);
+	for (len = be32_to_cpu(root->ee_len); len; len--) {
+		fn(sb, bitmap, off);
+		off += sb->s_blocksize;
+	}
+}
@@ -0,0 +1,51 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Extent tree block mapping.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __EXTENTS_H
+#define __EXTENTS_H
+
+#include <linux/fs.h>
+
+/* Deepest tree, enough for 31^6 extents with 512 bytes blocks */
+#define PRAM_EXT_MAX_DEPTH	5
+
+/* Longest extent, so that its length fits in ee_len */
+#define PRAM_EXT_MAX_LEN	0x7fffffffUL
+
+/* Last file block that can be mapped */
+#define PRAM_EXT_MAX_BLOCK	0xfffffffeUL
+
+/* An extent in CPU byte order: len blocks from the file block lblk */
+struct pram_ext {
+	unsigned long lblk;	/* first file block */
+	unsigned long pblk;	/* first data block, absolute blocknr */
+	unsigned long len;	/* number of blocks */
+};
+
+struct pram_free_batch;
+
+extern int pram_ext_find(struct super_block *sb, struct pram_inode *pi,
+			 unsigned long lblk, struct pram_ext *ext);
+extern int pram_ext_insert(struct inode *inode, struct pram_ext *ext);
+extern unsigned long pram_ext_remove(struct inode *inode, unsigned long first,
+				     unsigned long last,
+				     struct pram_free_batch *batch);
+extern void pram_ext_for_each_block(struct super_block *sb,
+				    struct pram_inode *pi,
+				    void (*fn)(struct super_block *sb,
+					       unsigned long *bitmap, u64 off),
+				    unsigned long *bitmap);
+
+static inline int pram_has_extents(struct pram_inode *pi)
+{
+	return pi->i_flags & cpu_to_be32(PRAM_EXTENTS_FL);
+}
+
+#endif	/* __EXTENTS_H */
@@ -20,6 +20,7 @@
 #include <linux/uaccess.h>
 #include <linux/falloc.h>
 #include "pram.h"
+#include "ntstore.h"
 #include "acl.h"
 #include "xip.h"
 #include "xattr.h"
@@ -39,7 +40,7 @@ static size_t __pram_iov_copy_from(char *vaddr,
 		int copy = min(bytes, iov->iov_len - base);
 
 		base = 0;
-		left = __copy_from_user(vaddr, buf, copy);
+		left = pram_copy_from_user(vaddr, buf, copy);
 		copied += copy;
 		bytes -= copy;
 		vaddr += copy;
@@ -80,7 +81,7 @@ static size_t pram_iov_copy_from(void *to, struct iov_iter *i, size_t bytes)
 	if (likely(i->nr_segs == 1)) {
 		int left;
 		char __user *buf = i->iov->iov_base + i->iov_offset;
-		left = __copy_from_user(to, buf, bytes);
+		left = pram_copy_from_user(to, buf, bytes);
 		copied = bytes - left;
 	} else {
 		copied = __pram_iov_copy_from(to, i->iov, i->iov_offset, bytes);
@@ -105,6 +106,37 @@ static size_t pram_iov_copy_to(void *from, struct iov_iter *i, size_t bytes)
 	return copied;
 }
 
+/*
+ * Copy bytes from i to the pramfs memory at to, a write window at a time.
+ * The window can't sleep (see wprotect.h), so the copy runs with the page
+ * faults disabled: the missing user pages are faulted in out of the window
+ * and the copy resumed, as generic_perform_write() does. It returns the
+ * number of bytes copied, short only if the user memory is bad.
+ */
+static size_t pram_iov_write(struct super_block *sb, u8 *to,
+			     struct iov_iter *i, size_t bytes)
+{
+	struct iov_iter iter = *i;
+	size_t copied = 0, len, done;
+	void *dst;
+
+	while (copied < bytes) {
+		len = min_t(size_t, bytes - copied, PRAM_WP_BATCH);
+		dst = pram_memunlock_data(sb, to + copied, len);
+		pagefault_disable();
+		done = pram_iov_copy_from(dst, &iter, len);
+		pagefault_enable();
+		pram_memlock_data(sb, to + copied, len);
+
+		iov_iter_advance(&iter, done);
+		copied += done;
+		if (done < len &&
+		    iov_iter_fault_in_readable(&iter, len - done))
+			break;
+	}
+	return copied;
+}
+
 static size_t __pram_clear_user(const struct iovec *iov, size_t base,
 				size_t bytes)
 {
@@ -148,6 +180,15 @@ static int pram_open_file(struct inode *inode, struct file *filp)
 	return generic_file_open(inode, filp);
 }
 
+static int pram_release_file(struct inode *inode, struct file *filp)
+{
+	/* the last writer is gone, no more appends to preallocate for */
+	if ((filp->f_mode & FMODE_WRITE) &&
+	    atomic_read(&inode->i_writecount) == 1)
+		pram_discard_prealloc(inode);
+	return 0;
+}
+
 ssize_t pram_direct_IO(int rw, struct kiocb *iocb,
 		   const struct iovec *iov,
 		   loff_t offset, unsigned long nr_segs)
@@ -155,6 +196,9 @@ ssize_t pram_direct_IO(int rw, struct kiocb *iocb,
 	struct file *file = iocb->ki_filp;
 	struct inode *inode = file->f_mapping->host;
 	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	u8 data[PRAM_INLINE_DATA_SIZE];
+	struct pram_wp_batch batch;
 	int progress = 0, hole = 0, alloc_once = 1;
 	ssize_t retval = 0;
 	unsigned long blocknr, blockoff, blocknr_start;
@@ -193,23 +237,73 @@ ssize_t pram_direct_IO(int rw, struct kiocb *iocb,
 
 	iov_iter_init(&iter, iov, nr_segs, length, 0);
 
+	if (rw == READ && pram_get_inline_data(inode, data)) {
+		/* past the inline data the file is a hole */
+		size_t count = offset < PRAM_INLINE_DATA_SIZE ?
+			min_t(size_t, length,
+			      PRAM_INLINE_DATA_SIZE - offset) : 0;
+
+		if (count &&
+		    pram_iov_copy_to(data + offset, &iter, count) != count) {
+			retval = -EFAULT;
+			goto out;
+		}
+		iov_iter_advance(&iter, count);
+		if (pram_clear_user(&iter, length - count) != length - count) {
+			retval = -EFAULT;
+			goto out;
+		}
+		retval = length;
+		goto out;
+	}
+
+	if (rw == WRITE && pram_has_inline_data(pi)) {
+		if (offset + length <= PRAM_INLINE_DATA_SIZE) {
+			/* the user copy may fault, not in the write window */
+			if (pram_iov_copy_from(data, &iter, length) != length) {
+				retval = -EFAULT;
+				goto out;
+			}
+			pram_memunlock_inode(sb, pi);
+			memcpy(&pi->i_type.data[offset], data, length);
+			pram_memlock_inode(sb, pi);
+			retval = length;
+			goto out;
+		}
+		/* the write doesn't fit, the data go to a block */
+		retval = pram_unpack_inline_data(inode);
+		if (retval)
+			goto out;
+	}
+
 	while (length) {
-		int count;
+		size_t count;
+		unsigned long run;
 		u8 *bp = NULL;
-		u64 block = pram_find_data_block(inode, blocknr);
+		u64 block;
+
+		/* the whole run of contiguous blocks is copied at once */
+		run = pram_find_data_blocks(inode, blocknr, num_blocks -
+					    (blocknr - blocknr_start), &block);
 		if (!block) {
 			if (alloc_once && rw == WRITE) {
 				/*
 				 * Allocate the data blocks starting from
-				 * blocknr to the end.
+				 * blocknr to the end. No user copy in the
+				 * batch, see pram_wp_batch_begin().
 				 */
+				pram_wp_batch_begin(sb, &batch);
 				retval = pram_alloc_blocks(inode, blocknr,
 							num_blocks - (blocknr -
 								blocknr_start));
+				pram_wp_batch_end(&batch);
 				if (retval)
 					goto out;
 				/* retry....*/
-				block = pram_find_data_block(inode, blocknr);
+				run = pram_find_data_blocks(inode, blocknr,
+						num_blocks -
+						(blocknr - blocknr_start),
+						&block);
 				BUG_ON(!block);
 				alloc_once = 0;
 			} else if (unlikely(rw == READ)) {
@@ -224,10 +318,11 @@ ssize_t pram_direct_IO(int rw, struct kiocb *iocb,
 			goto out;
 		}
  hole:
-		++blocknr;
+		blocknr += run;
 
-		count = blockoff + length > sb->s_blocksize ?
-			sb->s_blocksize - blockoff : length;
+		count = ((size_t)run << sb->s_blocksize_bits) - blockoff;
+		if (count > length)
+			count = length;
 
 		if (rw == READ) {
 			if (unlikely(hole)) {
@@ -245,15 +340,17 @@ ssize_t pram_direct_IO(int rw, struct kiocb *iocb,
 				}
 			}
 		} else {
-			pram_memunlock_block(sb, bp);
-			retval = pram_iov_copy_from(&bp[blockoff], &iter,
-							count);
+			/*
+			 * The blocks of the run are contiguous in memory too,
+			 * the write windows cover them in batches instead of
+			 * one block at a time.
+			 */
+			retval = pram_iov_write(sb, &bp[blockoff], &iter,
+						count);
 			if (retval != count) {
 				retval = -EFAULT;
-				pram_memlock_block(sb, bp);
 				goto out;
 			}
-			pram_memlock_block(sb, bp);
 		}
 
 		progress += count;
@@ -379,6 +476,7 @@ const struct file_operations pram_file_operations = {
 	.aio_write	= generic_file_aio_write,
 	.mmap		= generic_file_readonly_mmap,
 	.open		= pram_open_file,
+	.release	= pram_release_file,
 	.fsync		= noop_fsync,
 	.check_flags	= pram_check_flags,
 	.unlocked_ioctl	= pram_ioctl,
@@ -396,6 +494,7 @@ const struct file_operations pram_xip_file_operations = {
 	.write		= xip_file_write,
 	.mmap		= pram_xip_file_mmap,
 	.open		= generic_file_open,
+	.release	= pram_release_file,
 	.fsync		= noop_fsync,
 	.unlocked_ioctl	= pram_ioctl,
 	.fallocate	= pram_fallocate,
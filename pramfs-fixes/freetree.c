@@ -0,0 +1,308 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Free blocks extent tree.
+ *
+ * The on-media bitmap is the reference for the free space, but searching
+ * it is linear in the size of the filesystem. At mount time the free runs
+ * of the bitmap are indexed in an augmented rb tree kept in DRAM, then
+ * every allocation and free keeps both of them in sync. The callers must
+ * serialize the accesses to a tree.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#include <linux/slab.h>
+#include <linux/rbtree_augmented.h>
+#include "freetree.h"
+#include "pram.h"
+
+static struct kmem_cache *pram_free_extent_cache;
+
+static inline struct pram_free_extent *fext_entry(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct pram_free_extent, node) : NULL;
+}
+
+static inline unsigned long fext_compute_max(struct pram_free_extent *fe)
+{
+	unsigned long max = fe->len;
+	struct pram_free_extent *child;
+
+	child = fext_entry(fe->node.rb_left);
+	if (child && child->max_len > max)
+		max = child->max_len;
+	child = fext_entry(fe->node.rb_right);
+	if (child && child->max_len > max)
+		max = child->max_len;
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, fext_callbacks, struct pram_free_extent, node,
+		     unsigned long, max_len, fext_compute_max)
+
+static struct pram_free_extent *fext_alloc(unsigned long start,
+					   unsigned long len)
+{
+	struct pram_free_extent *fe;
+
+	/*
+	 * We can't fail here: a free run missing from the tree would
+	 * be lost until the next mount.
+	 */
+	fe = kmem_cache_alloc(pram_free_extent_cache, GFP_NOFS | __GFP_NOFAIL);
+	fe->start = start;
+	fe->len = len;
+	fe->max_len = len;
+	return fe;
+}
+
+static void fext_link(struct rb_root *root, struct pram_free_extent *new)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct pram_free_extent *fe;
+
+	while (*p) {
+		parent = *p;
+		fe = fext_entry(parent);
+		if (fe->max_len < new->len)
+			fe->max_len = new->len;
+		if (new->start < fe->start)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+
+	rb_link_node(&new->node, parent, p);
+	rb_insert_augmented(&new->node, root, &fext_callbacks);
+}
+
+static void fext_erase(struct rb_root *root, struct pram_free_extent *fe)
+{
+	rb_erase_augmented(&fe->node, root, &fext_callbacks);
+	kmem_cache_free(pram_free_extent_cache, fe);
+}
+
+/*
+ * Find the extent containing block, or the first one after it if block
+ * is not free. In prev it returns the extent just before block.
+ */
+static struct pram_free_extent *fext_lookup(struct rb_root *root,
+					    unsigned long block,
+					    struct pram_free_extent **prev)
+{
+	struct rb_node *n = root->rb_node;
+	struct pram_free_extent *fe, *next = NULL;
+
+	*prev = NULL;
+	while (n) {
+		fe = fext_entry(n);
+		if (block < fe->start) {
+			next = fe;
+			n = n->rb_left;
+		} else if (block >= fe->start + fe->len) {
+			*prev = fe;
+			n = n->rb_right;
+		} else {
+			return fe;
+		}
+	}
+	return next;
+}
+
+/* pram_free_tree_insert()
+ *
+ * Add a run of free blocks to the tree, merging it with the adjacent
+ * extents.
+ */
+void pram_free_tree_insert(struct rb_root *root, unsigned long start,
+			   unsigned long len)
+{
+	struct pram_free_extent *prev, *next;
+
+	next = fext_lookup(root, start, &prev);
+	BUG_ON(next && next->start < start + len);
+
+	if (prev && prev->start + prev->len == start) {
+		prev->len += len;
+		if (next && start + len == next->start) {
+			prev->len += next->len;
+			fext_erase(root, next);
+		}
+		fext_callbacks_propagate(&prev->node, NULL);
+	} else if (next && start + len == next->start) {
+		next->start = start;
+		next->len += len;
+		fext_callbacks_propagate(&next->node, NULL);
+	} else {
+		fext_link(root, fext_alloc(start, len));
+	}
+}
+
+/* pram_free_tree_remove()
+ *
+ * Remove a run of blocks from the tree. The run must be part of a
+ * single extent.
+ */
+void pram_free_tree_remove(struct rb_root *root, unsigned long start,
+			   unsigned long len)
+{
+	struct pram_free_extent *fe, *prev;
+	unsigned long end;
+
+	fe = fext_lookup(root, start, &prev);
+	BUG_ON(!fe || fe->start > start || start + len > fe->start + fe->len);
+
+	end = fe->start + fe->len;
+	if (fe->start == start && fe->len == len) {
+		fext_erase(root, fe);
+		return;
+	}
+
+	if (fe->start == start) {
+		fe->start += len;
+		fe->len -= len;
+		fext_callbacks_propagate(&fe->node, NULL);
+		return;
+	}
+
+	/* the run is in the tail or in the middle of the extent */
+	fe->len = start - fe->start;
+	fext_callbacks_propagate(&fe->node, NULL);
+	if (start + len < end)
+		fext_link(root, fext_alloc(start + len, end - start - len));
+}
+
+/* pram_free_tree_first_fit()
+ *
+ * Find the lowest extent at least want blocks long. It returns its
+ * length, zero if there isn't any.
+ */
+unsigned long pram_free_tree_first_fit(struct rb_root *root,
+				       unsigned long want,
+				       unsigned long *start)
+{
+	struct rb_node *n = root->rb_node;
+	struct pram_free_extent *fe, *left;
+
+	if (!n || fext_entry(n)->max_len < want)
+		return 0;
+
+	while (n) {
+		fe = fext_entry(n);
+		left = fext_entry(n->rb_left);
+		if (left && left->max_len >= want) {
+			n = n->rb_left;
+		} else if (fe->len >= want) {
+			*start = fe->start;
+			return fe->len;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	/* max_len out of sync? */
+	BUG();
+	return 0;
+}
+
+static int fext_aligned_fit(struct rb_node *n, unsigned long want,
+			    unsigned long align, unsigned long off,
+			    unsigned long *start)
+{
+	struct pram_free_extent *fe = fext_entry(n);
+	unsigned long s;
+
+	if (!fe || fe->max_len < want)
+		return 0;
+	if (fext_aligned_fit(n->rb_left, want, align, off, start))
+		return 1;
+	if (fe->len >= want) {
+		s = ALIGN(fe->start + off, align) - off;
+		if (s + want <= fe->start + fe->len) {
+			*start = s;
+			return 1;
+		}
+	}
+	return fext_aligned_fit(n->rb_right, want, align, off, start);
+}
+
+/* pram_free_tree_aligned_fit()
+ *
+ * Find the lowest run of want free blocks whose first block plus off is
+ * a multiple of align, a power of two. The subtrees without an extent at
+ * least want blocks long are skipped. It returns 1 if a run was found.
+ */
+int pram_free_tree_aligned_fit(struct rb_root *root, unsigned long want,
+			       unsigned long align, unsigned long off,
+			       unsigned long *start)
+{
+	return fext_aligned_fit(root->rb_node, want, align, off, start);
+}
+
+/* pram_free_tree_near()
+ *
+ * Find the free blocks closest to goal: the extent containing it, or the
+ * first one after it, wrapping to the start of the tree. It returns the
+ * number of free blocks from start, zero if the tree is empty.
+ */
+unsigned long pram_free_tree_near(struct rb_root *root, unsigned long goal,
+				  unsigned long *start)
+{
+	struct pram_free_extent *fe, *prev;
+
+	fe = fext_lookup(root, goal, &prev);
+	if (fe) {
+		*start = max(goal, fe->start);
+	} else {
+		fe = fext_entry(rb_first(root));
+		if (!fe)
+			return 0;
+		*start = fe->start;
+	}
+
+	return fe->start + fe->len - *start;
+}
+
+/* pram_free_tree_first()
+ *
+ * Return the lowest free block, or ULONG_MAX if the tree is empty.
+ */
+unsigned long pram_free_tree_first(struct rb_root *root)
+{
+	struct pram_free_extent *fe = fext_entry(rb_first(root));
+
+	return fe ? fe->start : ULONG_MAX;
+}
+
+/* pram_free_tree_erase()
+ *
+ * Free all objects in the tree.
+ */
+void pram_free_tree_erase(struct rb_root *root)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(root))) {
+		rb_erase(n, root);
+		kmem_cache_free(pram_free_extent_cache, fext_entry(n));
+	}
+}
+
+int __init init_pram_free_tree(void)
+{
+	pram_free_extent_cache = kmem_cache_create("pram_free_extent",
+					sizeof(struct pram_free_extent),
+					0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!pram_free_extent_cache)
+		return -ENOMEM;
+	return 0;
+}
+
+void exit_pram_free_tree(void)
+{
+	kmem_cache_destroy(pram_free_extent_cache);
+}
@@ -0,0 +1,55 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Free blocks extent tree.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __FREETREE_H
+#define __FREETREE_H
+
+#include <linux/rbtree.h>
+
+/*
+ * A run of free blocks. The tree is sorted by start block and every node
+ * keeps the length of the longest run in its subtree, so that a run of
+ * a given length can be found without visiting the whole tree.
+ */
+struct pram_free_extent {
+	struct rb_node node;	/* node in the rb tree */
+	unsigned long start;	/* first free block */
+	unsigned long len;	/* number of free blocks */
+	unsigned long max_len;	/* longest run in this subtree */
+};
+
+extern int init_pram_free_tree(void) __init;
+extern void exit_pram_free_tree(void);
+extern void pram_free_tree_insert(struct rb_root *root, unsigned long start,
+				  unsigned long len);
+extern void pram_free_tree_remove(struct rb_root *root, unsigned long start,
+				  unsigned long len);
+extern unsigned long pram_free_tree_first_fit(struct rb_root *root,
+					      unsigned long want,
+					      unsigned long *start);
+extern int pram_free_tree_aligned_fit(struct rb_root *root,
+				      unsigned long want, unsigned long align,
+				      unsigned long off, unsigned long *start);
+extern unsigned long pram_free_tree_near(struct rb_root *root,
+					 unsigned long goal,
+					 unsigned long *start);
+extern unsigned long pram_free_tree_first(struct rb_root *root);
+extern void pram_free_tree_erase(struct rb_root *root);
+
+/* Length of the longest run of free blocks in the tree */
+static inline unsigned long pram_free_tree_max_len(struct rb_root *root)
+{
+	if (!root->rb_node)
+		return 0;
+	return rb_entry(root->rb_node, struct pram_free_extent,
+			node)->max_len;
+}
+
+#endif	/* __FREETREE_H */
@@ -18,9 +18,13 @@
 #include <linux/module.h>
 #include <linux/mpage.h>
 #include <linux/backing-dev.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
 #include "pram.h"
 #include "xattr.h"
 #include "xip.h"
+#include "ntstore.h"
+#include "extents.h"
 #include "acl.h"
 
 struct backing_dev_info pram_backing_dev_info __read_mostly = {
@@ -29,155 +33,700 @@ struct backing_dev_info pram_backing_dev_info __read_mostly = {
 };
 
 /*
- * allocate a data block for inode and return it's absolute blocknr.
- * Zeroes out the block if zero set. Increments inode->i_blocks.
+ * Account num new data blocks to inode. If eofblocks is set some of them
+ * are beyond the end of file.
  */
-static int pram_new_data_block(struct inode *inode, unsigned long *blocknr,
-			       int zero)
+static void pram_add_data_blocks(struct inode *inode, unsigned long num,
+				 int eofblocks)
 {
-	int errval = pram_new_block(inode->i_sb, blocknr, zero);
+	struct pram_inode *pi = pram_get_inode(inode->i_sb, inode->i_ino);
 
-	if (!errval) {
-		struct pram_inode *pi = pram_get_inode(inode->i_sb,
-							inode->i_ino);
-		inode->i_blocks++;
-		pram_memunlock_inode(inode->i_sb, pi);
-		pi->i_blocks = cpu_to_be32(inode->i_blocks);
-		pram_memlock_inode(inode->i_sb, pi);
-	}
+	inode->i_blocks += num;
+	pram_memunlock_inode(inode->i_sb, pi);
+	pi->i_blocks = cpu_to_be32(inode->i_blocks);
+	if (eofblocks)
+		pi->i_flags |= cpu_to_be32(PRAM_EOFBLOCKS_FL);
+	pram_memlock_inode(inode->i_sb, pi);
+}
+
+/*
+ * Unaccount the num data blocks in batch from inode and give them back.
+ * Whatever the mapping format, nothing may point to them anymore.
+ */
+static void pram_put_data_blocks(struct inode *inode, unsigned long num,
+				 struct pram_free_batch *batch)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+
+	inode->i_blocks -= num;
+	pram_memunlock_inode(sb, pi);
+	pi->i_blocks = cpu_to_be32(inode->i_blocks);
+	pram_memlock_inode(sb, pi);
+
+	pram_map_cache_invalidate(inode);
+	pram_free_batch_flush(sb, batch);
+}
+
+/* Give back num data blocks from blocknr, just allocated to inode */
+static void pram_drop_data_blocks(struct inode *inode, unsigned long blocknr,
+				  unsigned long num)
+{
+	struct pram_free_batch batch;
+	unsigned long i;
+
+	pram_init_free_batch(&batch);
+	for (i = 0; i < num; i++)
+		pram_free_batch_add(inode->i_sb, &batch, blocknr + i);
+	pram_put_data_blocks(inode, num, &batch);
+}
+
+/*
+ * The allocation goal keeping the file clustered: right after the block
+ * pointed by ptrs[i - 1], if any, else goal.
+ */
+static inline unsigned long pram_ptr_goal(struct super_block *sb,
+					  const u64 *ptrs, unsigned long i,
+					  unsigned long goal)
+{
+	if (i && ptrs[i - 1])
+		return pram_get_blocknr(sb, be64_to_cpu(ptrs[i - 1])) + 1;
+	return goal;
+}
+
+/*
+ * allocate up to num physically contiguous data blocks for inode, near
+ * the block goal if not zero, and return the absolute blocknr of the
+ * first one and how many have been allocated. Zeroes out the blocks if
+ * zero set. Increments inode->i_blocks.
+ */
+static int pram_new_data_blocks(struct inode *inode, unsigned long goal,
+				unsigned long num, unsigned long *blocknr,
+				unsigned long *got, int zero)
+{
+	int errval = pram_new_blocks(inode->i_sb, goal, num, blocknr, got,
+				     zero);
+
+	if (!errval)
+		pram_add_data_blocks(inode, *got, 0);
 
 	return errval;
 }
 
 /*
- * find the offset to the block represented by the given inode's file
- * relative block number.
+ * allocate up to num data blocks for the file block iblock, beyond the
+ * end of file, from the preallocation window of inode. If the window
+ * doesn't start at iblock it's replaced by a new one, right after the
+ * blocks allocated now and as long as the file, so that it grows with
+ * it. The blocks are always zeroed.
  */
-u64 pram_find_data_block(struct inode *inode, unsigned long file_blocknr)
+static int pram_new_append_blocks(struct inode *inode, unsigned long iblock,
+				  unsigned long goal, unsigned long num,
+				  unsigned long *blocknr, unsigned long *got)
+{
+	unsigned long start, len, win;
+	int errval;
+
+	len = pram_prealloc_take(inode, iblock, num, &start);
+	if (!len) {
+		pram_discard_prealloc(inode);
+		win = clamp_t(unsigned long, iblock, PRAM_PREALLOC_MIN,
+			      PRAM_PREALLOC_MAX);
+		errval = pram_new_blocks(inode->i_sb, goal, num + win, &start,
+					 &len, 1);
+		if (errval)
+			return errval;
+		if (len > num) {
+			pram_prealloc_set(inode, iblock + num, start + num,
+					  len - num);
+			len = num;
+		}
+	}
+
+	pram_add_data_blocks(inode, len, 0);
+	*blocknr = start;
+	*got = len;
+	return 0;
+}
+
+/* Check that the column entries [j, j + num) are all holes */
+static int pram_col_is_hole(u64 *col, int j, unsigned long num)
+{
+	while (num--)
+		if (col[j++])
+			return 0;
+	return 1;
+}
+
+/*
+ * Find the extent of inode containing iblock, or the first one after it.
+ * No lock is taken, the lookup is retried if the tree changed meanwhile.
+ */
+static int pram_find_extent(struct inode *inode, unsigned long iblock,
+			    struct pram_ext *ext)
 {
 	struct super_block *sb = inode->i_sb;
-	struct pram_inode *pi;
-	u64 *row; /* ptr to row block */
-	u64 *col; /* ptr to column blocks */
-	u64 bp = 0;
-	unsigned int i_row, i_col;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned int s;
+	int found;
+
+	do {
+		s = read_seqcount_begin(seq);
+		found = pram_ext_find(sb, pi, iblock, ext);
+	} while (read_seqcount_retry(seq, s));
+
+	return found;
+}
+
+/*
+ * Mapping cache.
+ *
+ * Every lookup of a file block walks the block arrays or the extent tree
+ * in pramfs memory, that can be much slower than DRAM. The last runs of
+ * blocks found are kept in the inode and searched first. The blocks of a
+ * file never move, so a run stays valid until they are unmapped: the
+ * allocations leave the cache alone while every truncate invalidates it.
+ * A lookup racing with a truncate could add a run found before it, so a
+ * run is added only if the cache generation didn't change meanwhile.
+ */
+static unsigned long pram_map_cache_lookup(struct inode *inode,
+					   unsigned long iblock, u64 *off)
+{
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+	struct pram_map_run *run;
+	unsigned long pblk, len;
+	unsigned int s, i;
+
+	do {
+		s = read_seqcount_begin(&vi->i_map_seq);
+		/* the block 0 belongs to the bitmap */
+		pblk = 0;
+		len = 0;
+		for (i = 0; i < PRAM_MAP_CACHE_RUNS; i++) {
+			run = &vi->i_map[i];
+			if (iblock - run->lblk < run->len) {
+				pblk = run->pblk + iblock - run->lblk;
+				len = run->len - (iblock - run->lblk);
+				break;
+			}
+		}
+	} while (read_seqcount_retry(&vi->i_map_seq, s));
+
+	if (!pblk)
+		return 0;
+	*off = pram_get_block_off(inode->i_sb, pblk);
+	return len;
+}
+
+static inline unsigned int pram_map_cache_gen(struct inode *inode)
+{
+	unsigned int gen = ACCESS_ONCE(PRAM_I(inode)->i_map_gen);
+
+	/* pairs with the smp_wmb() in pram_map_cache_invalidate() */
+	smp_rmb();
+	return gen;
+}
+
+static void pram_map_cache_add(struct inode *inode, unsigned int gen,
+			       unsigned long lblk, unsigned long pblk,
+			       unsigned long len)
+{
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+	struct pram_map_run *run;
+	unsigned int i;
+
+	spin_lock(&vi->i_map_lock);
+	if (vi->i_map_gen != gen)
+		goto out;
+
+	/* another lookup of the same run got here first */
+	for (i = 0; i < PRAM_MAP_CACHE_RUNS; i++)
+		if (lblk - vi->i_map[i].lblk < vi->i_map[i].len)
+			goto out;
+
+	run = &vi->i_map[vi->i_map_next++ % PRAM_MAP_CACHE_RUNS];
+	write_seqcount_begin(&vi->i_map_seq);
+	run->lblk = lblk;
+	run->pblk = pblk;
+	run->len = len;
+	write_seqcount_end(&vi->i_map_seq);
+ out:
+	spin_unlock(&vi->i_map_lock);
+}
+
+/* pram_map_cache_invalidate()
+ *
+ * Drop the runs cached for inode. It must be called once the blocks have
+ * been unmapped, the lookups beyond the new size being already excluded.
+ */
+void pram_map_cache_invalidate(struct inode *inode)
+{
+	struct pram_inode_vfs *vi = PRAM_I(inode);
+
+	/* a lookup seeing the new generation must see the new block map */
+	smp_wmb();
+	spin_lock(&vi->i_map_lock);
+	write_seqcount_begin(&vi->i_map_seq);
+	vi->i_map_gen++;
+	memset(vi->i_map, 0, sizeof(vi->i_map));
+	write_seqcount_end(&vi->i_map_seq);
+	spin_unlock(&vi->i_map_lock);
+}
+
+/* Run of blocks from iblock of an extent mapped inode, see below */
+static unsigned long pram_find_extent_blocks(struct inode *inode,
+					     unsigned int gen,
+					     unsigned long iblock,
+					     unsigned long count, u64 *block)
+{
+	struct pram_ext ext;
+
+	*block = 0;
+	if (!pram_find_extent(inode, iblock, &ext))
+		return count;
+	if (ext.lblk > iblock)
+		return min(ext.lblk - iblock, count);
+
+	pram_map_cache_add(inode, gen, ext.lblk, ext.pblk, ext.len);
+	*block = pram_get_block_off(inode->i_sb, ext.pblk + iblock - ext.lblk);
+	return min(ext.len - (iblock - ext.lblk), count);
+}
+
+/*
+ * Run of blocks from iblock pointed by the inode itself, see below. Inline
+ * data have no blocks at all. Returns zero if the inode has moved to the
+ * block arrays or to the extents: the pointers and the inline data are
+ * replaced under i_ext_seq, so the lookup is retried if they changed.
+ */
+static int pram_find_direct_blocks(struct inode *inode, struct pram_inode *pi,
+				   unsigned long iblock, unsigned long count,
+				   u64 *block, unsigned long *len)
+{
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned long i;
+	unsigned int s;
+	u64 first, bp;
+	int direct;
+
+	do {
+		s = read_seqcount_begin(seq);
+		direct = pi->i_flags & cpu_to_be32(PRAM_DIRECT_FL |
+						   PRAM_INLINE_DATA_FL);
+		first = 0;
+		i = count;
+		if (!direct || !pram_has_direct(pi) ||
+		    iblock >= PRAM_DIRECT_BLOCKS)
+			continue;
+		first = be64_to_cpu(pi->i_type.direct[iblock]);
+		for (i = 1; i < count && iblock + i < PRAM_DIRECT_BLOCKS; i++) {
+			bp = be64_to_cpu(pi->i_type.direct[iblock + i]);
+			if (bp != (first ? first +
+				   (i << inode->i_sb->s_blocksize_bits) : 0))
+				break;
+		}
+	} while (read_seqcount_retry(seq, s));
+
+	if (!direct)
+		return 0;
+	*block = first;
+	*len = i;
+	return 1;
+}
+
+/*
+ * The root of the block arrays of inode and their height. A new root is
+ * put above the old one under i_ext_seq, they are read together.
+ */
+static u64 pram_get_tree_root(struct inode *inode, struct pram_inode *pi,
+			      unsigned int *height)
+{
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned int s;
+	u64 root;
+
+	do {
+		s = read_seqcount_begin(seq);
+		root = be64_to_cpu(pi->i_type.reg.row_block);
+		*height = pram_tree_height(inode->i_sb, pi);
+	} while (read_seqcount_retry(seq, s));
+
+	return root;
+}
+
+/*
+ * The column block of the file block iblock, walking down from the root
+ * of the block arrays of the given height, or NULL in a hole. The levels
+ * are numbered from the columns, 0, and the rows, 1, up to the root.
+ */
+static u64 *pram_get_col(struct super_block *sb, u64 root,
+			 unsigned int height, unsigned long iblock)
+{
 	unsigned int N = sb->s_blocksize >> 3; /* num block ptrs per block */
 	unsigned int Nbits = sb->s_blocksize_bits - 3;
+	unsigned int level;
+	u64 *node;
 
-	pi = pram_get_inode(sb, inode->i_ino);
+	if (!pram_tree_covers(sb, height, iblock))
+		return NULL;
+
+	node = pram_get_block(sb, root);
+	for (level = height + 1; node && level; level--)
+		node = pram_get_block(sb, be64_to_cpu(
+				node[(iblock >> (level * Nbits)) & (N-1)]));
+	return node;
+}
+
+/*
+ * Run of blocks from iblock mapped by the block arrays, see below. Every
+ * column block is looked up once for all the entries of the range in it.
+ */
+static unsigned long pram_find_array_blocks(struct inode *inode,
+					    unsigned int gen,
+					    unsigned long iblock,
+					    unsigned long count, u64 *block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	u64 *col; /* ptr to column blocks */
+	u64 root, bp, first = 0;
+	unsigned int N = sb->s_blocksize >> 3; /* num block ptrs per block */
+	unsigned int height;
+	unsigned long i_col, len = 0;
+
+	*block = 0;
+	root = pram_get_tree_root(inode, pi, &height);
+	if (!root)
+		return count;
+
+	while (len < count) {
+		i_col = (iblock + len) & (N-1);
 
-	i_row = file_blocknr >> Nbits;
-	i_col  = file_blocknr & (N-1);
+		col = pram_get_col(sb, root, height, iblock + len);
+		if (!col) {
+			/* a whole column of holes */
+			if (first)
+				break;
+			len += min(N - i_col, count - len);
+			continue;
+		}
 
-	row = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
-	if (row) {
-		col = pram_get_block(sb, be64_to_cpu(row[i_row]));
-		if (col)
+		for (; i_col < N && len < count; i_col++, len++) {
 			bp = be64_to_cpu(col[i_col]);
+			if (!len)
+				first = bp;
+			else if (bp != (first ? first +
+					(len << sb->s_blocksize_bits) : 0))
+				goto out;
+		}
+	}
+ out:
+	if (first)
+		pram_map_cache_add(inode, gen, iblock,
+				   pram_get_blocknr(sb, first), len);
+	*block = first;
+	return len;
+}
+
+/* pram_find_data_blocks()
+ *
+ * Resolve the file blocks of inode from file_blocknr, up to count of
+ * them, to the run at their start: the blocks contiguous in memory, or
+ * the hole. The offset of the first block, or zero for a hole, is
+ * returned in block and the length of the run as the result.
+ */
+unsigned long pram_find_data_blocks(struct inode *inode,
+				    unsigned long file_blocknr,
+				    unsigned long count, u64 *block)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi;
+	unsigned long len;
+	unsigned int gen;
+
+	len = pram_map_cache_lookup(inode, file_blocknr, block);
+	if (len) {
+		percpu_counter_inc(&PRAM_SB(sb)->s_map_hits);
+		return min(len, count);
+	}
+	percpu_counter_inc(&PRAM_SB(sb)->s_map_misses);
+	gen = pram_map_cache_gen(inode);
+
+	pi = pram_get_inode(sb, inode->i_ino);
+	if (pram_find_direct_blocks(inode, pi, file_blocknr, count, block,
+				    &len)) {
+		if (*block)
+			pram_map_cache_add(inode, gen, file_blocknr,
+					   pram_get_blocknr(sb, *block), len);
+		return len;
 	}
+	if (pram_has_extents(pi))
+		return pram_find_extent_blocks(inode, gen, file_blocknr,
+					       count, block);
+	return pram_find_array_blocks(inode, gen, file_blocknr, count, block);
+}
+
+/* pram_get_inline_data()
+ *
+ * Copy the PRAM_INLINE_DATA_SIZE bytes of data stored in inode to buf.
+ * Returns zero if the inode has no inline data, they may have moved to a
+ * data block meanwhile.
+ */
+int pram_get_inline_data(struct inode *inode, void *buf)
+{
+	struct pram_inode *pi = pram_get_inode(inode->i_sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned int s;
+	int inline_data;
+
+	do {
+		s = read_seqcount_begin(seq);
+		inline_data = pram_has_inline_data(pi);
+		if (inline_data)
+			memcpy(buf, pi->i_type.data, PRAM_INLINE_DATA_SIZE);
+	} while (read_seqcount_retry(seq, s));
+
+	return inline_data;
+}
+
+/*
+ * find the offset to the block represented by the given inode's file
+ * relative block number.
+ */
+u64 pram_find_data_block(struct inode *inode, unsigned long file_blocknr)
+{
+	unsigned int N = inode->i_sb->s_blocksize >> 3;
+	u64 bp;
 
+	/* the rest of the column costs nothing more and goes in the cache */
+	pram_find_data_blocks(inode, file_blocknr,
+			      N - (file_blocknr & (N-1)), &bp);
 	return bp;
 }
 
+/*
+ * SEEK_DATA/SEEK_HOLE on an extent mapped inode: the data starts at the
+ * first extent from offset, the hole at the end of the extents running
+ * contiguously from it.
+ */
+static int pram_find_extent_region(struct inode *inode, loff_t *offset,
+				   int hole)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long iblock = *offset >> sb->s_blocksize_bits;
+	unsigned long end = (inode->i_size + sb->s_blocksize - 1) >>
+			    sb->s_blocksize_bits;
+	struct pram_ext ext;
+
+	if (!hole) {
+		if (!pram_find_extent(inode, iblock, &ext) || ext.lblk >= end)
+			return -ENXIO;
+		if (ext.lblk > iblock)
+			*offset = (loff_t)ext.lblk << sb->s_blocksize_bits;
+		return 0;
+	}
+
+	while (iblock < end && pram_find_extent(inode, iblock, &ext) &&
+	       ext.lblk <= iblock)
+		iblock = ext.lblk + ext.len;
+
+	if (iblock >= end)
+		*offset = inode->i_size;
+	else if (iblock > *offset >> sb->s_blocksize_bits)
+		*offset = (loff_t)iblock << sb->s_blocksize_bits;
+	return 0;
+}
+
+/*
+ * SEEK_DATA/SEEK_HOLE on an inode with direct pointers or block arrays:
+ * the runs are looked up from offset as in a read.
+ */
+static int pram_find_block_region(struct inode *inode, loff_t *offset,
+				  int hole)
+{
+	struct super_block *sb = inode->i_sb;
+	unsigned long iblock = *offset >> sb->s_blocksize_bits;
+	unsigned long end = (inode->i_size + sb->s_blocksize - 1) >>
+			    sb->s_blocksize_bits;
+	unsigned long len;
+	u64 block;
+
+	while (iblock < end) {
+		len = pram_find_data_blocks(inode, iblock, end - iblock,
+					    &block);
+		if (hole ? !block : !!block)
+			break;
+		iblock += len;
+	}
+
+	if (iblock >= end) {
+		if (!hole)
+			return -ENXIO;
+		*offset = inode->i_size;
+	} else if (iblock > *offset >> sb->s_blocksize_bits)
+		*offset = (loff_t)iblock << sb->s_blocksize_bits;
+	return 0;
+}
+
 /*
  * find the file offset for SEEK_DATA/SEEK_HOLE
  */
 int pram_find_region(struct inode *inode, loff_t *offset, int hole)
 {
-	struct super_block *sb = inode->i_sb;
-	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
-	int N = sb->s_blocksize >> 3; /* num block ptrs per block */
-	int first_row_index, last_row_index, i, j;
-	unsigned long first_blocknr, last_blocknr, blocks = 0, offset_in_block;
-	u64 *row; /* ptr to row block */
-	u64 *col; /* ptr to column blocks */
-	int data_found = 0, hole_found = 0;
+	struct pram_inode *pi = pram_get_inode(inode->i_sb, inode->i_ino);
 
 	if (*offset >= inode->i_size)
 		return -ENXIO;
 
-	if (!inode->i_blocks || !pi->i_type.reg.row_block) {
+	if (pram_has_extents(pi))
+		return pram_find_extent_region(inode, offset, hole);
+
+	/* the inline data run up to the end of file */
+	if (pram_has_inline_data(pi)) {
 		if (hole)
-			return inode->i_size;
-		else
-			return -ENXIO;
+			*offset = inode->i_size;
+		return 0;
 	}
 
-	offset_in_block = *offset & (sb->s_blocksize - 1);
+	return pram_find_block_region(inode, offset, hole);
+}
 
-	first_blocknr = *offset >> sb->s_blocksize_bits;
-	last_blocknr = inode->i_size >> sb->s_blocksize_bits;
+/*
+ * Unmap and free the file blocks first to last of an extent mapped inode.
+ * The caller holds i_ext_mutex.
+ */
+static void pram_remove_extents(struct inode *inode, unsigned long first,
+				unsigned long last)
+{
+	struct pram_free_batch batch;
 
-	first_row_index = first_blocknr >> (sb->s_blocksize_bits - 3);
-	last_row_index  = last_blocknr >> (sb->s_blocksize_bits - 3);
+	pram_init_free_batch(&batch);
+	pram_put_data_blocks(inode, pram_ext_remove(inode, first, last, &batch),
+			     &batch);
+}
 
-	row = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
+/*
+ * Free data blocks from an extent mapped inode in the range start <=> end.
+ * The caller holds i_ext_mutex.
+ */
+static void __pram_truncate_extents(struct inode *inode, loff_t start,
+				    loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	unsigned long first_blocknr, last_blocknr;
 
-	for (i = first_row_index; i <= last_row_index; i++) {
-		int first_col_index = (i == first_row_index) ?
-			first_blocknr & (N-1) : 0;
-		int last_col_index = (i == last_row_index) ?
-			last_blocknr & (N-1) : N-1;
-
-		if (!row[i]) {
-			hole_found = 1;
-			if (!hole)
-				blocks += sb->s_blocksize >> 3;
-			continue;
-		}
+	first_blocknr = (start + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
 
-		col = pram_get_block(sb, be64_to_cpu(row[i]));
+	if (pi->i_flags & cpu_to_be32(PRAM_EOFBLOCKS_FL))
+		last_blocknr = PRAM_EXT_MAX_BLOCK;
+	else
+		last_blocknr = end >> sb->s_blocksize_bits;
 
-		for (j = first_col_index; j <= last_col_index; j++) {
+	if (first_blocknr > last_blocknr)
+		return;
 
-			if (col[j]) {
-				data_found = 1;
-				if (!hole)
-					goto out;
-			} else
-				hole_found = 1;
+	pram_remove_extents(inode, first_blocknr, last_blocknr);
+}
 
-			if (!hole_found || !hole)
-				blocks++;
-		}
-		cond_resched();
-	}
- out:
-	/* Searching data but only hole found till the end */
-	if (!hole && !data_found && hole_found)
-		return -ENXIO;
+/*
+ * Free data blocks pointed by the inode itself in the range start <=> end
+ */
+static void __pram_truncate_direct(struct inode *inode, loff_t start,
+				   loff_t end)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	unsigned long i, first_blocknr, last_blocknr, blocknr;
+	unsigned int freed = 0;
+	struct pram_free_batch batch;
 
-	if (data_found && !hole_found) {
-		/* Searching data but we are alredy into them */
-		if (!hole)
-			return 0;
-		/* Searching hole but only data found, go to the end */
-		else {
-			*offset = inode->i_size;
-			return 0;
-		}
+	first_blocknr = (start + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
+
+	if (pi->i_flags & cpu_to_be32(PRAM_EOFBLOCKS_FL) ||
+	    end >> sb->s_blocksize_bits >= PRAM_DIRECT_BLOCKS)
+		last_blocknr = PRAM_DIRECT_BLOCKS - 1;
+	else
+		last_blocknr = end >> sb->s_blocksize_bits;
+
+	if (first_blocknr > last_blocknr)
+		return;
+
+	pram_init_free_batch(&batch);
+
+	pram_memunlock_inode(sb, pi);
+	for (i = first_blocknr; i <= last_blocknr; i++) {
+		if (!pi->i_type.direct[i])
+			continue;
+		blocknr = pram_get_blocknr(sb,
+					be64_to_cpu(pi->i_type.direct[i]));
+		pram_free_batch_add(sb, &batch, blocknr);
+		freed++;
+		pi->i_type.direct[i] = 0;
 	}
+	pram_memlock_inode(sb, pi);
+
+	pram_put_data_blocks(inode, freed, &batch);
+}
+
+/*
+ * Free the data blocks of the file blocks first to last under node, the
+ * block of the block arrays at level (see pram_get_col()) mapping the file
+ * blocks from base. The blocks of the arrays from first on are freed as
+ * well. Returns the number of data blocks freed.
+ */
+static unsigned long pram_truncate_level(struct super_block *sb, u64 *node,
+					 unsigned int level, unsigned long base,
+					 unsigned long first,
+					 unsigned long last,
+					 struct pram_free_batch *batch)
+{
+	unsigned int N = sb->s_blocksize >> 3; /* num block ptrs per block */
+	unsigned int shift = level * (sb->s_blocksize_bits - 3);
+	unsigned long j, first_j, last_j, child, freed = 0;
+
+	first_j = first > base ? (first - base) >> shift : 0;
+	last_j = min_t(unsigned long, N-1, (last - base) >> shift);
 
-	/* Searching for hole, hole found and starting inside an hole */
-	if (hole && hole_found && !blocks) {
-			/* we found data after it */
-			if (data_found)
-				return 0;
-			else {
-				/* last hole */
-				*offset = inode->i_size;
-				return 0;
+	if (!level) {
+		pram_memunlock_block(sb, node);
+		for (j = first_j; j <= last_j; j++) {
+			if (unlikely(!node[j]))
+				continue;
+			/* the flush sleeps, not in the write window */
+			if (pram_free_batch_full(batch)) {
+				pram_memlock_block(sb, node);
+				pram_free_batch_flush(sb, batch);
+				pram_memunlock_block(sb, node);
 			}
+			pram_free_batch_add(sb, batch, pram_get_blocknr(sb,
+						be64_to_cpu(node[j])));
+			freed++;
+			node[j] = 0;
+		}
+		pram_memlock_block(sb, node);
+		cond_resched();
+		return freed;
 	}
 
-	if (offset_in_block) {
-		blocks--;
-		*offset += (blocks << sb->s_blocksize_bits) +
-					(sb->s_blocksize - offset_in_block);
-	} else
-		*offset += blocks << sb->s_blocksize_bits;
+	for (j = first_j; j <= last_j; j++) {
+		if (unlikely(!node[j]))
+			continue;
 
-	return 0;
+		child = base + (j << shift);
+		freed += pram_truncate_level(sb, pram_get_block(sb,
+					     be64_to_cpu(node[j])), level - 1,
+					     child, first, last, batch);
+		if (child < first)
+			continue;
+
+		pram_free_batch_add(sb, batch, pram_get_blocknr(sb,
+					be64_to_cpu(node[j])));
+		pram_memunlock_block(sb, node);
+		node[j] = 0;
+		pram_memlock_block(sb, node);
+	}
+	return freed;
 }
 
 /*
@@ -188,13 +737,32 @@ static void __pram_truncate_blocks(struct inode *inode, loff_t start,
 {
 	struct super_block *sb = inode->i_sb;
 	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
-	int N = sb->s_blocksize >> 3; /* num block ptrs per block */
-	int Nbits = sb->s_blocksize_bits - 3;
-	int first_row_index, last_row_index, i, j;
-	unsigned long blocknr, first_blocknr, last_blocknr;
-	unsigned int freed = 0;
-	u64 *row; /* ptr to row block */
-	u64 *col; /* ptr to column blocks */
+	unsigned long blocknr, first_blocknr, last_blocknr, freed;
+	struct pram_free_batch batch;
+	u64 *root;
+
+	if (pram_has_extents(pi)) {
+		mutex_lock(&PRAM_I(inode)->i_ext_mutex);
+		__pram_truncate_extents(inode, start, end);
+		mutex_unlock(&PRAM_I(inode)->i_ext_mutex);
+		return;
+	}
+
+	if (pram_has_direct(pi)) {
+		__pram_truncate_direct(inode, start, end);
+		return;
+	}
+
+	/* the inline data beyond the new end must read as zeroes */
+	if (pram_has_inline_data(pi)) {
+		if (start < PRAM_INLINE_DATA_SIZE) {
+			pram_memunlock_inode(sb, pi);
+			memset(pi->i_type.data + start, 0,
+			       PRAM_INLINE_DATA_SIZE - start);
+			pram_memlock_inode(sb, pi);
+		}
+		return;
+	}
 
 	if (!pi->i_type.reg.row_block)
 		return;
@@ -202,79 +770,422 @@ static void __pram_truncate_blocks(struct inode *inode, loff_t start,
 	first_blocknr = (start + sb->s_blocksize - 1) >> sb->s_blocksize_bits;
 
 	if (pi->i_flags & cpu_to_be32(PRAM_EOFBLOCKS_FL))
-		last_blocknr = (1UL << (2*sb->s_blocksize_bits - 6)) - 1;
+		last_blocknr = ULONG_MAX;
 	else
 		last_blocknr = end >> sb->s_blocksize_bits;
 
 	if (first_blocknr > last_blocknr)
 		return;
 
-	first_row_index = first_blocknr >> Nbits;
-	last_row_index  = last_blocknr >> Nbits;
+	root = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
+	pram_init_free_batch(&batch);
 
-	row = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
+	freed = pram_truncate_level(sb, root, pram_tree_height(sb, pi) + 1, 0,
+				    first_blocknr, last_blocknr, &batch);
 
-	for (i = first_row_index; i <= last_row_index; i++) {
-		int first_col_index = (i == first_row_index) ?
-			first_blocknr & (N-1) : 0;
-		int last_col_index = (i == last_row_index) ?
-			last_blocknr & (N-1) : N-1;
+	if (start == 0) {
+		blocknr = pram_get_blocknr(sb,
+					be64_to_cpu(pi->i_type.reg.row_block));
+		pram_free_batch_add(sb, &batch, blocknr);
+		pram_memunlock_inode(sb, pi);
+		pi->i_type.reg.row_block = 0;
+		pi->i_type.reg.height = 0;
+		pram_memlock_inode(sb, pi);
+	}
 
-		if (unlikely(!row[i]))
-			continue;
+	pram_put_data_blocks(inode, freed, &batch);
+}
 
-		col = pram_get_block(sb, be64_to_cpu(row[i]));
+static void pram_truncate_blocks(struct inode *inode, loff_t start, loff_t end)
+{
+	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
+	      S_ISLNK(inode->i_mode)))
+		return;
 
-		for (j = first_col_index; j <= last_col_index; j++) {
+	__pram_truncate_blocks(inode, start, end);
+	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+	pram_update_inode(inode);
+}
 
-			if (unlikely(!col[j]))
+/*
+ * Allocate the holes of an extent mapped inode from the file block iblock
+ * to iblock + num - 1, each one with a single run if possible. huge and
+ * eof are as in pram_alloc_blocks().
+ */
+static int pram_alloc_extent_blocks(struct inode *inode, unsigned long iblock,
+				    unsigned long num, unsigned long huge,
+				    unsigned long eof)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	unsigned long lblk = iblock, end = iblock + num, goal = 0;
+	unsigned long blocknr, got, hole, lblk_huge, undo = iblock;
+	struct pram_ext ext, next;
+	int errval = 0;
+
+	if (end - 1 > PRAM_EXT_MAX_BLOCK)
+		return -EFBIG;
+
+	mutex_lock(&PRAM_I(inode)->i_ext_mutex);
+
+	/* keep the file clustered after its previous block */
+	if (lblk && pram_ext_find(sb, pi, lblk - 1, &ext) && ext.lblk < lblk)
+		goal = ext.pblk + lblk - ext.lblk;
+
+	while (lblk < end) {
+		hole = end;
+		if (pram_ext_find(sb, pi, lblk, &ext)) {
+			if (ext.lblk <= lblk) {
+				goal = ext.pblk + ext.len;
+				lblk = ext.lblk + ext.len;
+				undo = lblk;
 				continue;
+			}
+			hole = min(ext.lblk, end);
+		}
 
-			blocknr = pram_get_blocknr(sb, be64_to_cpu(col[j]));
-			pram_free_block(sb, blocknr);
-			freed++;
-			pram_memunlock_block(sb, col);
-			col[j] = 0;
-			pram_memlock_block(sb, col);
+		/*
+		 * reserve the whole huge page around the block, the blocks
+		 * not yet written are kept beyond eof.
+		 */
+		lblk_huge = lblk & ~(huge - 1);
+		if (huge && (!pram_ext_find(sb, pi, lblk_huge, &next) ||
+			     next.lblk >= lblk_huge + huge) &&
+		    !pram_new_huge_blocks(sb, goal, &blocknr)) {
+			pram_add_data_blocks(inode, huge, 1);
+			lblk = lblk_huge;
+			undo = min(undo, lblk);
+			got = huge;
+		} else if (lblk >= eof) {
+			errval = pram_new_append_blocks(inode, lblk, goal,
+							hole - lblk, &blocknr,
+							&got);
+		} else {
+			errval = pram_new_data_blocks(inode, goal, hole - lblk,
+						      &blocknr, &got, 1);
+		}
+		if (errval) {
+			pram_dbg("fail to alloc data block\n");
+			/*
+			 * give back the blocks allocated since the last extent
+			 * that was already mapped. The runs before it stay:
+			 * they sit below i_size or among EOFBLOCKS extents, so
+			 * a truncate still finds them.
+			 */
+			if (lblk != undo)
+				pram_remove_extents(inode, undo, lblk - 1);
+			break;
+		}
+
+		ext.lblk = lblk;
+		ext.pblk = blocknr;
+		ext.len = got;
+		errval = pram_ext_insert(inode, &ext);
+		if (errval) {
+			pram_dbg("fail to insert extent\n");
+			pram_drop_data_blocks(inode, blocknr, got);
+			break;
+		}
+		goal = blocknr + got;
+		lblk += got;
+	}
+
+	mutex_unlock(&PRAM_I(inode)->i_ext_mutex);
+	return errval;
+}
+
+/*
+ * Allocate the holes among the direct pointers of inode from the file
+ * block iblock to iblock + num - 1, all below PRAM_DIRECT_BLOCKS.
+ */
+static int pram_alloc_direct_blocks(struct inode *inode, unsigned long iblock,
+				    unsigned long num)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	unsigned long i, k, hole, blocknr, got, goal = 0, set = 0;
+	struct pram_free_batch batch;
+	int errval;
+
+	BUILD_BUG_ON(PRAM_DIRECT_BLOCKS > BITS_PER_LONG);
+
+	for (i = iblock; i < iblock + num; i += got) {
+		got = 1;
+		if (pi->i_type.direct[i])
+			continue;
+
+		goal = pram_ptr_goal(sb, (u64 *)pi->i_type.direct, i, goal);
+
+		for (hole = 1; i + hole < iblock + num &&
+		     !pi->i_type.direct[i + hole]; hole++)
+			;
+
+		errval = pram_new_data_blocks(inode, goal, hole, &blocknr,
+					      &got, 1);
+		if (errval) {
+			pram_dbg("fail to alloc data block\n");
+			/* give back only the pointers set above */
+			pram_init_free_batch(&batch);
+			pram_memunlock_inode(sb, pi);
+			for_each_set_bit(k, &set, PRAM_DIRECT_BLOCKS) {
+				pram_free_batch_add(sb, &batch,
+					pram_get_blocknr(sb,
+					be64_to_cpu(pi->i_type.direct[k])));
+				pi->i_type.direct[k] = 0;
+			}
+			pram_memlock_inode(sb, pi);
+			pram_put_data_blocks(inode, hweight_long(set), &batch);
+			return errval;
+		}
+
+		pram_memunlock_inode(sb, pi);
+		for (k = 0; k < got; k++) {
+			pi->i_type.direct[i + k] =
+				cpu_to_be64(pram_get_block_off(sb,
+							       blocknr + k));
+			set |= 1UL << (i + k);
+		}
+		pram_memlock_inode(sb, pi);
+	}
+
+	return 0;
+}
+
+/*
+ * The file outgrows the direct pointers of inode: they move to the first
+ * column of new block arrays.
+ */
+static int pram_direct_to_arrays(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned long row_blocknr = 0, col_blocknr;
+	u64 *row, *col;
+	int i, errval;
+
+	for (i = 0; i < PRAM_DIRECT_BLOCKS; i++)
+		if (pi->i_type.direct[i])
+			break;
+
+	/* without data blocks the arrays start empty */
+	if (i < PRAM_DIRECT_BLOCKS) {
+		errval = pram_new_block(sb, &row_blocknr, 1);
+		if (errval)
+			return errval;
+		errval = pram_new_block(sb, &col_blocknr, 1);
+		if (errval) {
+			pram_free_block(sb, row_blocknr);
+			return errval;
+		}
+
+		col = pram_get_block(sb, pram_get_block_off(sb, col_blocknr));
+		pram_memunlock_block(sb, col);
+		for (i = 0; i < PRAM_DIRECT_BLOCKS; i++)
+			col[i] = pi->i_type.direct[i];
+		pram_memlock_block(sb, col);
+
+		row = pram_get_block(sb, pram_get_block_off(sb, row_blocknr));
+		pram_memunlock_block(sb, row);
+		row[0] = cpu_to_be64(pram_get_block_off(sb, col_blocknr));
+		pram_memlock_block(sb, row);
+	}
+
+	/* a lookup must see either the pointers or the arrays */
+	write_seqcount_begin(seq);
+	pram_memunlock_inode(sb, pi);
+	memset(&pi->i_type, 0, sizeof(pi->i_type));
+	if (row_blocknr)
+		pi->i_type.reg.row_block =
+			cpu_to_be64(pram_get_block_off(sb, row_blocknr));
+	pi->i_flags &= cpu_to_be32(~PRAM_DIRECT_FL);
+	pram_memlock_inode(sb, pi);
+	write_seqcount_end(seq);
+
+	return 0;
+}
+
+/* Block mapping of the new regular files or symlinks of sb with data blocks */
+static u32 pram_block_map_flags(struct super_block *sb, umode_t mode)
+{
+	if (S_ISREG(mode) && test_opt(sb, EXTENTS))
+		return PRAM_EXTENTS_FL;
+	if ((S_ISREG(mode) || S_ISLNK(mode)) && test_opt(sb, DIRECT))
+		return PRAM_DIRECT_FL;
+	return 0;
+}
+
+/* pram_unpack_inline_data()
+ *
+ * The file outgrows the data stored in inode: they move to its first
+ * data block, mapped as it would have been without PRAM_INLINE_DATA_FL.
+ * The new mapping is built aside and then replaces the data at once, so
+ * a lookup never sees the file without them. The caller holds i_mutex.
+ */
+int pram_unpack_inline_data(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned long blocknr = 0, row_blocknr = 0, col_blocknr;
+	u32 flags = pram_block_map_flags(sb, inode->i_mode);
+	u64 *row, *col;
+	void *bp;
+	int errval;
+
+	/* an empty file starts with an empty mapping */
+	if (inode->i_size) {
+		errval = pram_new_block(sb, &blocknr, 1);
+		if (errval)
+			return errval;
+		bp = pram_get_block(sb, pram_get_block_off(sb, blocknr));
+		pram_memunlock_block(sb, bp);
+		memcpy(bp, pi->i_type.data, PRAM_INLINE_DATA_SIZE);
+		pram_memlock_block(sb, bp);
+	}
+
+	if (blocknr && !flags) {
+		errval = pram_new_block(sb, &row_blocknr, 1);
+		if (errval)
+			goto fail;
+		errval = pram_new_block(sb, &col_blocknr, 1);
+		if (errval) {
+			pram_free_block(sb, row_blocknr);
+			goto fail;
 		}
 
-		cond_resched();
+		col = pram_get_block(sb, pram_get_block_off(sb, col_blocknr));
+		pram_memunlock_block(sb, col);
+		col[0] = cpu_to_be64(pram_get_block_off(sb, blocknr));
+		pram_memlock_block(sb, col);
+
+		row = pram_get_block(sb, pram_get_block_off(sb, row_blocknr));
+		pram_memunlock_block(sb, row);
+		row[0] = cpu_to_be64(pram_get_block_off(sb, col_blocknr));
+		pram_memlock_block(sb, row);
+	}
+
+	write_seqcount_begin(seq);
+	pram_memunlock_inode(sb, pi);
+	memset(&pi->i_type, 0, sizeof(pi->i_type));
+	if (blocknr && (flags & PRAM_EXTENTS_FL)) {
+		pi->i_type.ext.ee_len = cpu_to_be32(1);
+		pi->i_type.ext.ee_start =
+			cpu_to_be64(pram_get_block_off(sb, blocknr));
+	} else if (blocknr && (flags & PRAM_DIRECT_FL))
+		pi->i_type.direct[0] =
+			cpu_to_be64(pram_get_block_off(sb, blocknr));
+	else if (blocknr)
+		pi->i_type.reg.row_block =
+			cpu_to_be64(pram_get_block_off(sb, row_blocknr));
+	pi->i_flags &= cpu_to_be32(~PRAM_INLINE_DATA_FL);
+	pi->i_flags |= cpu_to_be32(flags);
+	pram_memlock_inode(sb, pi);
+	write_seqcount_end(seq);
+
+	if (blocknr)
+		pram_add_data_blocks(inode, 1, 0);
+	return 0;
+ fail:
+	pram_free_block(sb, blocknr);
+	return errval;
+}
+
+/*
+ * Make the block arrays of inode deep enough for the file block last,
+ * putting new roots above the old one. A lookup reads the root and the
+ * height together under i_ext_seq, and the old root stays valid below.
+ */
+static int pram_grow_tree(struct inode *inode, unsigned long last)
+{
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	seqcount_t *seq = &PRAM_I(inode)->i_ext_seq;
+	unsigned int height = pram_tree_height(sb, pi);
+	unsigned long blocknr;
+	u64 *root;
+	int errval;
+
+	/* without 64 bits sizes the arrays keep their two levels */
+	if (!test_opt(sb, 64BIT) && !pram_tree_covers(sb, 0, last))
+		return -EFBIG;
 
-		if (first_col_index == 0) {
-			blocknr = pram_get_blocknr(sb, be64_to_cpu(row[i]));
-			pram_free_block(sb, blocknr);
-			pram_memunlock_block(sb, row);
-			row[i] = 0;
-			pram_memlock_block(sb, row);
+	/* an empty file gets its root right at the needed height */
+	if (!pi->i_type.reg.row_block) {
+		while (!pram_tree_covers(sb, height, last))
+			height++;
+		/* alloc the 2nd order array block */
+		errval = pram_new_block(sb, &blocknr, 1);
+		if (errval) {
+			pram_dbg("failed to alloc 2nd order array block\n");
+			return errval;
 		}
+		write_seqcount_begin(seq);
+		pram_memunlock_inode(sb, pi);
+		pi->i_type.reg.row_block = cpu_to_be64(pram_get_block_off(sb,
+								      blocknr));
+		pi->i_type.reg.height = height;
+		pram_memlock_inode(sb, pi);
+		write_seqcount_end(seq);
+		return 0;
 	}
 
-	inode->i_blocks -= freed;
+	while (!pram_tree_covers(sb, height, last)) {
+		errval = pram_new_block(sb, &blocknr, 1);
+		if (errval) {
+			pram_dbg("failed to alloc index block\n");
+			return errval;
+		}
+		root = pram_get_block(sb, pram_get_block_off(sb, blocknr));
+		pram_memunlock_block(sb, root);
+		root[0] = pi->i_type.reg.row_block;
+		pram_memlock_block(sb, root);
 
-	if (start == 0) {
-		blocknr = pram_get_blocknr(sb,
-					be64_to_cpu(pi->i_type.reg.row_block));
-		pram_free_block(sb, blocknr);
+		write_seqcount_begin(seq);
 		pram_memunlock_inode(sb, pi);
-		pi->i_type.reg.row_block = 0;
-		goto update_blocks;
+		pi->i_type.reg.row_block = cpu_to_be64(pram_get_block_off(sb,
+								      blocknr));
+		pi->i_type.reg.height = ++height;
+		pram_memlock_inode(sb, pi);
+		write_seqcount_end(seq);
 	}
-	pram_memunlock_inode(sb, pi);
-
- update_blocks:
-	pi->i_blocks = cpu_to_be32(inode->i_blocks);
-	pram_memlock_inode(sb, pi);
+	return 0;
 }
 
-static void pram_truncate_blocks(struct inode *inode, loff_t start, loff_t end)
+/*
+ * Find the 2nd order array block pointing to the row i, the file blocks
+ * from i * N, allocating it and the index blocks above it if needed.
+ */
+static int pram_get_row_alloc(struct inode *inode, unsigned long i, u64 **row)
 {
-	if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
-	      S_ISLNK(inode->i_mode)))
-		return;
+	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
+	unsigned int N = sb->s_blocksize >> 3; /* num block ptrs per block */
+	unsigned int Nbits = sb->s_blocksize_bits - 3;
+	unsigned int level;
+	unsigned long blocknr, idx;
+	u64 *node;
+	int errval;
+
+	node = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
+	for (level = pram_tree_height(sb, pi) + 1; level > 1; level--) {
+		idx = (i >> ((level - 1) * Nbits)) & (N-1);
+		if (!node[idx]) {
+			errval = pram_new_block(sb, &blocknr, 1);
+			if (errval) {
+				pram_dbg("failed to alloc index block\n");
+				return errval;
+			}
+			pram_memunlock_block(sb, node);
+			node[idx] = cpu_to_be64(pram_get_block_off(sb,
+								   blocknr));
+			pram_memlock_block(sb, node);
+		}
+		node = pram_get_block(sb, be64_to_cpu(node[idx]));
+	}
 
-	__pram_truncate_blocks(inode, start, end);
-	inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
-	pram_update_inode(inode);
+	*row = node;
+	return 0;
 }
 
 /*
@@ -289,26 +1200,44 @@ int pram_alloc_blocks(struct inode *inode, int file_blocknr, unsigned int num)
 	int Nbits = sb->s_blocksize_bits - 3;
 	int first_file_blocknr;
 	int last_file_blocknr;
-	int first_row_index, last_row_index;
-	int i, j, errval;
-	unsigned long blocknr;
-	u64 *row;
+	unsigned long first_row_index, last_row_index, i;
+	int j, errval;
+	unsigned long blocknr, goal = 0, huge = 0, eof = ULONG_MAX;
+	u64 *row = NULL;
 	u64 *col;
 
-	if (!pi->i_type.reg.row_block) {
-		/* alloc the 2nd order array block */
-		errval = pram_new_block(sb, &blocknr, 1);
-		if (errval) {
-			pram_dbg("failed to alloc 2nd order array block\n");
+	/* With xip_huge, file data goes in huge page aligned runs */
+	if (test_opt(sb, XIP_HUGE) && S_ISREG(inode->i_mode) &&
+	    pram_huge_blocks(sb) <= N)
+		huge = pram_huge_blocks(sb);
+	else if (S_ISREG(inode->i_mode))
+		/* appends go through the preallocation window */
+		eof = (i_size_read(inode) + sb->s_blocksize - 1) >>
+			sb->s_blocksize_bits;
+
+	if (pram_has_inline_data(pi)) {
+		errval = pram_unpack_inline_data(inode);
+		if (errval)
+			goto fail;
+	}
+
+	if (pram_has_extents(pi))
+		return pram_alloc_extent_blocks(inode, file_blocknr, num, huge,
+						eof);
+
+	if (pram_has_direct(pi)) {
+		if (!huge && file_blocknr + num <= PRAM_DIRECT_BLOCKS)
+			return pram_alloc_direct_blocks(inode, file_blocknr,
+							num);
+		errval = pram_direct_to_arrays(inode);
+		if (errval)
 			goto fail;
-		}
-		pram_memunlock_inode(sb, pi);
-		pi->i_type.reg.row_block = cpu_to_be64(pram_get_block_off(sb,
-								      blocknr));
-		pram_memlock_inode(sb, pi);
 	}
 
-	row = pram_get_block(sb, be64_to_cpu(pi->i_type.reg.row_block));
+	/* make room in the block arrays up to the last block */
+	errval = pram_grow_tree(inode, file_blocknr + num - 1);
+	if (errval)
+		goto fail;
 
 	first_file_blocknr = file_blocknr;
 	last_file_blocknr = file_blocknr + num - 1;
@@ -319,11 +1248,18 @@ int pram_alloc_blocks(struct inode *inode, int file_blocknr, unsigned int num)
 	for (i = first_row_index; i <= last_row_index; i++) {
 		int first_col_index, last_col_index;
 
+		/* the 2nd order array block changes every N rows */
+		if (!row || !(i & (N-1))) {
+			errval = pram_get_row_alloc(inode, i, &row);
+			if (errval)
+				goto fail;
+		}
+
 		/*
 		 * we are starting a new row, so make sure
 		 * there is a block allocated for the row.
 		 */
-		if (!row[i]) {
+		if (!row[i & (N-1)]) {
 			/* allocate the row block */
 			errval = pram_new_block(sb, &blocknr, 1);
 			if (errval) {
@@ -331,10 +1267,11 @@ int pram_alloc_blocks(struct inode *inode, int file_blocknr, unsigned int num)
 				goto fail;
 			}
 			pram_memunlock_block(sb, row);
-			row[i] = cpu_to_be64(pram_get_block_off(sb, blocknr));
+			row[i & (N-1)] = cpu_to_be64(pram_get_block_off(sb,
+								   blocknr));
 			pram_memlock_block(sb, row);
 		}
-		col = pram_get_block(sb, be64_to_cpu(row[i]));
+		col = pram_get_block(sb, be64_to_cpu(row[i & (N-1)]));
 
 		first_col_index = (i == first_row_index) ?
 			first_file_blocknr & (N-1) : 0;
@@ -343,24 +1280,57 @@ int pram_alloc_blocks(struct inode *inode, int file_blocknr, unsigned int num)
 			last_file_blocknr & (N-1) : N-1;
 
 		for (j = first_col_index; j <= last_col_index; j++) {
-			if (!col[j]) {
-				errval = pram_new_data_block(inode, &blocknr,
-							     1);
-				if (errval) {
-					pram_dbg("fail to alloc data block\n");
-					if (j != first_col_index) {
-						__pram_truncate_blocks(inode,
-							inode->i_size,
-					inode->i_size + ((j - first_col_index)
-					<< inode->i_sb->s_blocksize_bits));
-					}
-					goto fail;
+			unsigned long got, iblock;
+			int k, hole, j_huge;
+
+			if (col[j])
+				continue;
+
+			goal = pram_ptr_goal(sb, col, j, goal);
+
+			/*
+			 * reserve the whole huge page around the block, the
+			 * blocks not yet written are kept beyond eof.
+			 */
+			j_huge = j & ~(huge - 1);
+			if (huge && pram_col_is_hole(col, j_huge, huge) &&
+			    !pram_new_huge_blocks(sb, goal, &blocknr)) {
+				pram_add_data_blocks(inode, huge, 1);
+				j = j_huge;
+				got = huge;
+				goto fill;
+			}
+
+			/* allocate the whole hole with a single run */
+			for (hole = 1; j + hole <= last_col_index &&
+			     !col[j + hole]; hole++)
+				;
+
+			iblock = ((unsigned long)i << Nbits) + j;
+			if (iblock >= eof)
+				errval = pram_new_append_blocks(inode, iblock,
+						goal, hole, &blocknr, &got);
+			else
+				errval = pram_new_data_blocks(inode, goal, hole,
+							      &blocknr, &got, 1);
+			if (errval) {
+				pram_dbg("fail to alloc data block\n");
+				if (j != first_col_index) {
+					__pram_truncate_blocks(inode,
+						inode->i_size,
+				inode->i_size + ((j - first_col_index)
+				<< inode->i_sb->s_blocksize_bits));
 				}
-				pram_memunlock_block(sb, col);
-				col[j] = cpu_to_be64(pram_get_block_off(sb,
-								      blocknr));
-				pram_memlock_block(sb, col);
+				goto fail;
 			}
+ fill:
+			pram_memunlock_block(sb, col);
+			for (k = 0; k < got; k++)
+				col[j + k] = cpu_to_be64(pram_get_block_off(sb,
+								blocknr + k));
+			pram_memlock_block(sb, col);
+			goal = blocknr + got;
+			j += got - 1;
 		}
 	}
 
@@ -385,7 +1355,7 @@ static int pram_read_inode(struct inode *inode, struct pram_inode *pi)
 	i_uid_write(inode, be32_to_cpu(pi->i_uid));
 	i_gid_write(inode, be32_to_cpu(pi->i_gid));
 	set_nlink(inode, be16_to_cpu(pi->i_links_count));
-	inode->i_size = be32_to_cpu(pi->i_size);
+	inode->i_size = pram_inode_size(inode->i_sb, pi);
 	inode->i_atime.tv_sec = be32_to_cpu(pi->i_atime);
 	inode->i_ctime.tv_sec = be32_to_cpu(pi->i_ctime);
 	inode->i_mtime.tv_sec = be32_to_cpu(pi->i_mtime);
@@ -457,7 +1427,7 @@ int pram_update_inode(struct inode *inode)
 	pi->i_uid = cpu_to_be32(i_uid_read(inode));
 	pi->i_gid = cpu_to_be32(i_gid_read(inode));
 	pi->i_links_count = cpu_to_be16(inode->i_nlink);
-	pi->i_size = cpu_to_be32(inode->i_size);
+	pram_set_inode_size(inode->i_sb, pi, inode->i_size);
 	pi->i_blocks = cpu_to_be32(inode->i_blocks);
 	pi->i_atime = cpu_to_be32(inode->i_atime.tv_sec);
 	pi->i_ctime = cpu_to_be32(inode->i_ctime.tv_sec);
@@ -485,38 +1455,576 @@ int pram_update_inode(struct inode *inode)
 static void pram_free_inode(struct inode *inode)
 {
 	struct super_block *sb = inode->i_sb;
-	struct pram_super_block *ps;
 	struct pram_inode *pi;
 	unsigned long inode_nr;
 
 	pram_xattr_delete_inode(inode);
 
-	mutex_lock(&PRAM_SB(sb)->s_lock);
-
-	inode_nr = (inode->i_ino - PRAM_ROOT_INO) >> PRAM_INODE_BITS;
+	inode_nr = pram_ino_to_nr(sb, inode->i_ino);
 
 	pi = pram_get_inode(sb, inode->i_ino);
 	pram_memunlock_inode(sb, pi);
 	pi->i_dtime = cpu_to_be32(get_seconds());
-	pi->i_type.reg.row_block = 0;
+	memset(&pi->i_type, 0, sizeof(pi->i_type));
 	pi->i_xattr = 0;
 	pram_memlock_inode(sb, pi);
 
-	/* increment s_free_inodes_count */
-	ps = pram_get_super(sb);
-	pram_memunlock_super(sb, ps);
-	if (inode_nr < be32_to_cpu(ps->s_free_inode_hint))
-		ps->s_free_inode_hint = cpu_to_be32(inode_nr);
-	be32_add_cpu(&ps->s_free_inodes_count, 1);
-	if (be32_to_cpu(ps->s_free_inodes_count) ==
-					 be32_to_cpu(ps->s_inodes_count) - 1) {
-		/* filesystem is empty */
-		pram_dbg("fs is empty!\n");
-		ps->s_free_inode_hint = cpu_to_be32(1);
+	/* increment the free inodes count */
+	pram_release_inode_nr(sb, inode_nr, S_ISDIR(inode->i_mode));
+}
+
+/*
+ * Inode allocation.
+ *
+ * The inodes in use are tracked by a bitmap, built in DRAM at mount time
+ * scanning the inode table. The table is split in groups, as many as the
+ * CPUs, each one with its own free and directories counters and search
+ * cursor. A slot is claimed with test_and_set_bit(), so allocations and
+ * frees don't take any lock. The groups are aligned to the bitmap words.
+ *
+ * The inodes are placed Orlov style, so that a directory walk touches
+ * nearby slots: a new directory goes in a group with many free inodes
+ * and few directories, at the start of a free bitmap word, while a file
+ * goes right after its parent directory. A group is left for the next
+ * ones only when it's full.
+ */
+
+/* Groups are added when the inode table grows */
+static inline unsigned int pram_inode_groups_count(struct pram_sb_info *sbi)
+{
+	unsigned int n = ACCESS_ONCE(sbi->s_inode_groups_count);
+
+	/* pairs with the smp_wmb() in pram_grow_inode_table() */
+	smp_rmb();
+	return n;
+}
+
+static inline struct pram_inode_group *
+pram_get_inode_group(struct pram_sb_info *sbi, unsigned long inode_nr)
+{
+	if (inode_nr < sbi->s_static_inodes)
+		return &sbi->s_inode_groups[inode_nr /
+					    sbi->s_inode_group_size];
+	return &sbi->s_inode_groups[sbi->s_static_groups +
+			(inode_nr - sbi->s_chunk_base) / PRAM_INODES_PER_CHUNK];
+}
+
+/*
+ * Claim a free slot of group ig, searching from the slot goal, or from the
+ * cursor of the group if goal is not in it, to the end of the group, then
+ * from its start. Returns the slot, -1 if there's none.
+ */
+static long pram_inode_group_alloc(struct pram_sb_info *sbi,
+				   struct pram_inode_group *ig,
+				   unsigned long goal)
+{
+	unsigned long i, from = goal;
+	int wrapped = 0, use_hint = 0;
+
+	if (from < ig->start || from >= ig->end) {
+		from = ACCESS_ONCE(ig->hint);
+		use_hint = 1;
+	}
+	if (from < ig->start || from >= ig->end)
+		from = ig->start;
+
+	i = from;
+	for (;;) {
+		i = find_next_zero_bit(sbi->s_inode_bitmap, ig->end, i);
+		if (i >= ig->end) {
+			if (wrapped || from == ig->start)
+				return -1;
+			wrapped = 1;
+			i = ig->start;
+			continue;
+		}
+		/* another CPU may have claimed it in the meantime */
+		if (!test_and_set_bit(i, sbi->s_inode_bitmap))
+			break;
+		i++;
+	}
+
+	if (use_hint)
+		ig->hint = i + 1;
+	atomic_long_dec(&ig->free);
+	return i;
+}
+
+/*
+ * Claim the first slot of a free bitmap word of group ig, so that a new
+ * directory has room for its children right after it. The search starts
+ * from the cursor of the group. Returns the slot, -1 if there's none.
+ */
+static long pram_inode_group_alloc_region(struct pram_sb_info *sbi,
+					  struct pram_inode_group *ig)
+{
+	unsigned long first = ig->start / BITS_PER_LONG;
+	unsigned long n = (ig->end - ig->start) / BITS_PER_LONG;
+	unsigned long k, w, from = ACCESS_ONCE(ig->hint);
+
+	if (!n)
+		return -1;
+	from = (from < ig->start || from >= ig->end) ? 0 :
+		(from - ig->start) / BITS_PER_LONG;
+
+	for (k = 0; k < n; k++) {
+		w = first + (from + k) % n;
+		if (!ACCESS_ONCE(sbi->s_inode_bitmap[w]) &&
+		    !test_and_set_bit(w * BITS_PER_LONG, sbi->s_inode_bitmap)) {
+			atomic_long_dec(&ig->free);
+			return w * BITS_PER_LONG;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Choose the group of a new directory. A subdirectory stays in the group
+ * of its parent if that has more free inodes and fewer directories than
+ * the average. Otherwise, and always for the top level directories, the
+ * directories are spread: among the groups with more free inodes than
+ * the average, the one with fewest directories is taken, starting from a
+ * random one for the top level.
+ */
+static unsigned int pram_find_dir_group(struct super_block *sb,
+					unsigned long parent_nr)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned int i, g, best, ngroups = pram_inode_groups_count(sbi);
+	struct pram_inode_group *ig;
+	long avg_free, avg_dirs = 0, dirs, best_dirs = LONG_MAX;
+
+	avg_free = percpu_counter_read_positive(&sbi->s_freeinodes_counter) /
+		ngroups;
+	for (i = 0; i < ngroups; i++)
+		avg_dirs += atomic_read(&sbi->s_inode_groups[i].dirs);
+	avg_dirs /= ngroups;
+
+	ig = pram_get_inode_group(sbi, parent_nr);
+	g = ig - sbi->s_inode_groups;
+	if (parent_nr) {
+		if (atomic_long_read(&ig->free) >= avg_free &&
+		    atomic_read(&ig->dirs) <= avg_dirs)
+			return g;
+	} else {
+		g = prandom_u32() % ngroups;
+	}
+
+	best = g;
+	for (i = 0; i < ngroups; i++) {
+		ig = &sbi->s_inode_groups[(g + i) % ngroups];
+		if (atomic_long_read(&ig->free) < avg_free)
+			continue;
+		dirs = atomic_read(&ig->dirs);
+		if (dirs < best_dirs) {
+			best_dirs = dirs;
+			best = (g + i) % ngroups;
+		}
+	}
+	return best;
+}
+
+/*
+ * Claim a free slot of the inode table for a new inode of type mode in
+ * the directory dir. Returns the slot, -1 if the inode table is full.
+ */
+static long pram_alloc_inode_nr(struct super_block *sb, struct inode *dir,
+				umode_t mode)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long parent_nr, goal;
+	unsigned int i, g, ngroups = pram_inode_groups_count(sbi);
+	struct pram_inode_group *ig;
+	long inode_nr;
+
+	parent_nr = pram_ino_to_nr(sb, dir->i_ino);
+	if (S_ISDIR(mode)) {
+		g = pram_find_dir_group(sb, parent_nr);
+		goal = ULONG_MAX;
+	} else {
+		g = pram_get_inode_group(sbi, parent_nr) - sbi->s_inode_groups;
+		goal = parent_nr + 1;
+	}
+
+	for (i = 0; i < ngroups; i++) {
+		ig = &sbi->s_inode_groups[(g + i) % ngroups];
+		if (atomic_long_read(&ig->free) <= 0)
+			continue;
+		inode_nr = -1;
+		if (S_ISDIR(mode))
+			inode_nr = pram_inode_group_alloc_region(sbi, ig);
+		if (inode_nr < 0)
+			inode_nr = pram_inode_group_alloc(sbi, ig, goal);
+		if (inode_nr >= 0) {
+			if (S_ISDIR(mode))
+				atomic_inc(&ig->dirs);
+			percpu_counter_dec(&sbi->s_freeinodes_counter);
+			pram_dirty_counters(sb);
+			return inode_nr;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Give back the slot inode_nr, of a directory if dir is set. The inode
+ * must have already been marked free in the inode table.
+ */
+void pram_release_inode_nr(struct super_block *sb, unsigned long inode_nr,
+			   int dir)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_inode_group *ig = pram_get_inode_group(sbi, inode_nr);
+
+	/* the inode must be free on media before anyone can reuse it */
+	smp_mb__before_clear_bit();
+	clear_bit(inode_nr, sbi->s_inode_bitmap);
+	if (dir)
+		atomic_dec(&ig->dirs);
+	atomic_long_inc(&ig->free);
+	if (inode_nr < ACCESS_ONCE(ig->hint))
+		ig->hint = inode_nr;
+	percpu_counter_inc(&sbi->s_freeinodes_counter);
+	pram_dirty_counters(sb);
+}
+
+/*
+ * Where to start searching for a free inode: the lowest cursor of the
+ * groups of the inode table laid out at format time. Only a hint, it's
+ * read without any lock.
+ */
+unsigned long pram_free_inode_hint(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long hint = ULONG_MAX;
+	unsigned int i;
+
+	for (i = 0; i < sbi->s_static_groups; i++)
+		hint = min(hint, ACCESS_ONCE(sbi->s_inode_groups[i].hint));
+	return hint;
+}
+
+/*
+ * Inode table chunks.
+ *
+ * The inode table laid out at format time can be extended by chunks of
+ * PRAM_INODES_PER_CHUNK inodes, allocated from the data blocks when it's
+ * full. The offsets of the chunks are recorded in the chunk map, a data
+ * block pointed by the super block, and their number in the super block.
+ * The inode numbers are offsets from the super block, so they don't depend
+ * on where the chunk is. The slots of chunk k in the inode bitmap start
+ * at s_chunk_base + k * PRAM_INODES_PER_CHUNK, and each chunk is an inode
+ * group of its own.
+ *
+ * The DRAM copy of the chunk map is replaced under RCU when the table
+ * grows, so that inode numbers can be translated without locks.
+ */
+
+/* Max number of chunks: the entries of the chunk map */
+static inline unsigned int pram_max_inode_chunks(struct super_block *sb)
+{
+	return sb->s_blocksize >> 3;
+}
+
+static inline unsigned long pram_inode_chunk_blocks(struct super_block *sb)
+{
+	return (PRAM_INODES_PER_CHUNK << PRAM_INODE_BITS) >>
+		sb->s_blocksize_bits;
+}
+
+static struct pram_inode_chunks *pram_alloc_inode_chunks(
+						struct super_block *sb)
+{
+	unsigned int max = pram_max_inode_chunks(sb);
+	struct pram_inode_chunks *ic;
+
+	ic = kzalloc(sizeof(*ic) + max * (sizeof(unsigned long) +
+					  sizeof(unsigned int)), GFP_KERNEL);
+	if (!ic)
+		return NULL;
+	ic->block = (unsigned long *)(ic + 1);
+	ic->sorted = (unsigned int *)(ic->block + max);
+	return ic;
+}
+
+/* Add the chunk at block to ic, keeping the sorted index in order */
+static void pram_add_inode_chunk(struct pram_inode_chunks *ic,
+				 unsigned long block)
+{
+	unsigned int i;
+
+	ic->block[ic->count] = block;
+	for (i = ic->count; i && ic->block[ic->sorted[i - 1]] > block; i--)
+		ic->sorted[i] = ic->sorted[i - 1];
+	ic->sorted[i] = ic->count;
+	ic->count++;
+}
+
+/* Return the inode number of the slot inode_nr */
+ino_t pram_inode_nr_to_ino(struct super_block *sb, unsigned long inode_nr)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_inode_chunks *ic;
+	unsigned long block;
+
+	if (inode_nr < sbi->s_static_inodes)
+		return PRAM_ROOT_INO + (inode_nr << PRAM_INODE_BITS);
+
+	inode_nr -= sbi->s_chunk_base;
+	rcu_read_lock();
+	ic = rcu_dereference(sbi->s_inode_chunks);
+	block = ic->block[inode_nr / PRAM_INODES_PER_CHUNK];
+	rcu_read_unlock();
+
+	return pram_get_block_off(sb, block) +
+		((inode_nr % PRAM_INODES_PER_CHUNK) << PRAM_INODE_BITS);
+}
+
+/*
+ * Return the slot of the inode number ino, -1 if ino is not the number
+ * of an inode.
+ */
+long pram_ino_to_nr(struct super_block *sb, u64 ino)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+	struct pram_inode_chunks *ic;
+	unsigned long blocknr, block;
+	unsigned int lo, hi, mid, k;
+	long inode_nr = -1;
+
+	if (ino < PRAM_ROOT_INO || (ino & (PRAM_INODE_SIZE - 1)))
+		return -1;
+	if (((ino - PRAM_ROOT_INO) >> PRAM_INODE_BITS) < sbi->s_static_inodes)
+		return (ino - PRAM_ROOT_INO) >> PRAM_INODE_BITS;
+	if (ino < be64_to_cpu(ps->s_bitmap_start))
+		return -1;
+
+	blocknr = pram_get_blocknr(sb, ino);
+
+	rcu_read_lock();
+	ic = rcu_dereference(sbi->s_inode_chunks);
+	/* find the last chunk starting at or before blocknr */
+	lo = 0;
+	hi = ic->count;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ic->block[ic->sorted[mid]] <= blocknr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo) {
+		k = ic->sorted[lo - 1];
+		block = ic->block[k];
+		if (blocknr < block + pram_inode_chunk_blocks(sb))
+			inode_nr = sbi->s_chunk_base +
+				k * PRAM_INODES_PER_CHUNK +
+				((ino - pram_get_block_off(sb, block)) >>
+				 PRAM_INODE_BITS);
+	}
+	rcu_read_unlock();
+
+	return inode_nr;
+}
+
+/* Set up the group ig of the slots [start, end) from the inode table */
+static unsigned long pram_init_inode_group(struct super_block *sb,
+					   struct pram_inode_group *ig,
+					   unsigned long start,
+					   unsigned long end)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_inode *pi;
+	unsigned long i, nfree = 0;
+
+	ig->start = start;
+	ig->end = end;
+	for (i = start; i < end; i++) {
+		pi = pram_get_inode(sb, pram_inode_nr_to_ino(sb, i));
+		if (pram_inode_is_free(pi)) {
+			nfree++;
+			continue;
+		}
+		__set_bit(i, sbi->s_inode_bitmap);
+		if (S_ISDIR(be16_to_cpu(pi->i_mode)))
+			atomic_inc(&ig->dirs);
+	}
+	atomic_long_set(&ig->free, nfree);
+	ig->hint = find_next_zero_bit(sbi->s_inode_bitmap, end, start);
+	return nfree;
+}
+
+/*
+ * Add a chunk to the inode table, called when it's full. Returns 0 if the
+ * table has free inodes again, because of this call or of a concurrent
+ * one.
+ */
+static int pram_grow_inode_table(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long nblocks = pram_inode_chunk_blocks(sb);
+	struct pram_inode_chunks *ic, *old;
+	struct pram_inode_group *ig;
+	unsigned long map_block, block, start;
+	unsigned int k;
+	__be64 *map;
+	int errval = 0;
+
+	mutex_lock(&sbi->s_lock);
+
+	for (k = 0; k < sbi->s_inode_groups_count; k++)
+		if (atomic_long_read(&sbi->s_inode_groups[k].free) > 0)
+			goto out;
+
+	old = rcu_dereference_protected(sbi->s_inode_chunks,
+					lockdep_is_held(&sbi->s_lock));
+	if (old->count >= pram_max_inode_chunks(sb)) {
+		errval = -ENOSPC;
+		goto out;
+	}
+
+	ic = pram_alloc_inode_chunks(sb);
+	if (!ic) {
+		errval = -ENOMEM;
+		goto out;
+	}
+
+	if (!ps->s_inode_map) {
+		errval = pram_new_block(sb, &map_block, 1);
+		if (errval)
+			goto out_free;
+		pram_memunlock_super(sb, ps);
+		ps->s_inode_map = cpu_to_be64(pram_get_block_off(sb,
+								 map_block));
+		pram_memlock_super(sb, ps);
 	}
+
+	/* the new inodes must be free, i.e. zeroed */
+	errval = pram_new_blocks_exact(sb, 0, nblocks, &block);
+	if (errval)
+		goto out_free;
+
+	/* the chunk exists only once it's counted in the super block */
+	map = pram_get_block(sb, be64_to_cpu(ps->s_inode_map));
+	pram_memunlock_block(sb, map);
+	map[old->count] = cpu_to_be64(pram_get_block_off(sb, block));
+	pram_memlock_block(sb, map);
+
+	pram_memunlock_super(sb, ps);
+	ps->s_inode_chunks = cpu_to_be32(old->count + 1);
 	pram_memlock_super(sb, ps);
 
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
+	memcpy(ic->block, old->block, old->count * sizeof(unsigned long));
+	memcpy(ic->sorted, old->sorted, old->count * sizeof(unsigned int));
+	ic->count = old->count;
+	pram_add_inode_chunk(ic, block);
+	rcu_assign_pointer(sbi->s_inode_chunks, ic);
+	kfree_rcu(old, rcu);
+
+	start = sbi->s_chunk_base + old->count * PRAM_INODES_PER_CHUNK;
+	ig = &sbi->s_inode_groups[sbi->s_inode_groups_count];
+	ig->start = start;
+	ig->end = start + PRAM_INODES_PER_CHUNK;
+	ig->hint = start;
+	atomic_long_set(&ig->free, PRAM_INODES_PER_CHUNK);
+	/* the group must be complete before it's visible */
+	smp_wmb();
+	sbi->s_inode_groups_count++;
+	sbi->s_inodes_count += PRAM_INODES_PER_CHUNK;
+
+	percpu_counter_add(&sbi->s_freeinodes_counter, PRAM_INODES_PER_CHUNK);
+	pram_dirty_counters(sb);
+	pram_dbg("inode table grown to %lu inodes\n", sbi->s_inodes_count);
+	goto out;
+
+ out_free:
+	kfree(ic);
+ out:
+	mutex_unlock(&sbi->s_lock);
+	return errval;
+}
+
+/*
+ * Build the in-use bitmap of the inode table and the inode groups, sized
+ * for the largest table. It returns the number of free inodes in free.
+ */
+int pram_init_inode_alloc(struct super_block *sb, unsigned long *free)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long count = be32_to_cpu(ps->s_inodes_count);
+	unsigned int chunks = be32_to_cpu(ps->s_inode_chunks);
+	unsigned int max = pram_max_inode_chunks(sb);
+	unsigned long size, start, max_slots;
+	struct pram_inode_chunks *ic;
+	__be64 *map = NULL;
+	unsigned int g, k;
+
+	if (chunks > max || (chunks && !ps->s_inode_map)) {
+		pram_err(sb, "bad inode table chunks count %u\n", chunks);
+		return -EINVAL;
+	}
+	if (chunks)
+		map = pram_get_block(sb, be64_to_cpu(ps->s_inode_map));
+
+	ic = pram_alloc_inode_chunks(sb);
+	if (!ic)
+		return -ENOMEM;
+	for (k = 0; k < chunks; k++)
+		pram_add_inode_chunk(ic, pram_get_blocknr(sb,
+						be64_to_cpu(map[k])));
+	RCU_INIT_POINTER(sbi->s_inode_chunks, ic);
+
+	sbi->s_static_inodes = count;
+	sbi->s_chunk_base = ALIGN(count, BITS_PER_LONG);
+	sbi->s_inodes_count = count + chunks * PRAM_INODES_PER_CHUNK;
+	max_slots = sbi->s_chunk_base + max * PRAM_INODES_PER_CHUNK;
+
+	sbi->s_inode_bitmap = vzalloc(BITS_TO_LONGS(max_slots) *
+				      sizeof(unsigned long));
+	if (!sbi->s_inode_bitmap)
+		goto fail;
+
+	size = ALIGN(DIV_ROUND_UP(count, nr_cpu_ids), BITS_PER_LONG);
+	size = max_t(unsigned long, size, PRAM_INODE_GROUP_MIN);
+	sbi->s_inode_group_size = size;
+	sbi->s_static_groups = DIV_ROUND_UP(count, size);
+	sbi->s_inode_groups = kcalloc(sbi->s_static_groups + max,
+				      sizeof(struct pram_inode_group),
+				      GFP_KERNEL);
+	if (!sbi->s_inode_groups)
+		goto fail;
+
+	*free = 0;
+	for (g = 0; g < sbi->s_static_groups; g++)
+		*free += pram_init_inode_group(sb, &sbi->s_inode_groups[g],
+				g * size, min((g + 1) * size, count));
+	for (k = 0; k < chunks; k++) {
+		start = sbi->s_chunk_base + k * PRAM_INODES_PER_CHUNK;
+		*free += pram_init_inode_group(sb,
+				&sbi->s_inode_groups[g + k], start,
+				start + PRAM_INODES_PER_CHUNK);
+	}
+	sbi->s_inode_groups_count = g + k;
+
+	return 0;
+ fail:
+	pram_destroy_inode_alloc(sb);
+	return -ENOMEM;
+}
+
+void pram_destroy_inode_alloc(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	kfree(sbi->s_inode_groups);
+	sbi->s_inode_groups = NULL;
+	vfree(sbi->s_inode_bitmap);
+	sbi->s_inode_bitmap = NULL;
+	kfree(rcu_dereference_protected(sbi->s_inode_chunks, 1));
+	RCU_INIT_POINTER(sbi->s_inode_chunks, NULL);
 }
 
 struct inode *pram_iget(struct super_block *sb, unsigned long ino)
@@ -549,19 +2057,23 @@ fail:
 
 void pram_evict_inode(struct inode *inode)
 {
+	struct pram_wp_batch batch;
 	int want_delete = 0;
 
 	if (!inode->i_nlink && !is_bad_inode(inode))
 		want_delete = 1;
 
 	truncate_inode_pages(&inode->i_data, 0);
+	pram_discard_prealloc(inode);
 
 	if (want_delete) {
 		sb_start_intwrite(inode->i_sb);
+		pram_wp_batch_begin(inode->i_sb, &batch);
 		/* unlink from chain in the inode's directory */
 		pram_remove_link(inode);
 		pram_truncate_blocks(inode, 0, inode->i_size);
 		inode->i_size = 0;
+		pram_wp_batch_end(&batch);
 	}
 
 	clear_inode(inode);
@@ -578,11 +2090,11 @@ struct inode *pram_new_inode(struct inode *dir, umode_t mode,
 {
 	struct super_block *sb;
 	struct pram_sb_info *sbi;
-	struct pram_super_block *ps;
 	struct inode *inode;
 	struct pram_inode *pi = NULL;
 	struct pram_inode *diri = NULL;
-	int i, errval;
+	long inode_nr;
+	int errval;
 	ino_t ino = 0;
 
 	sb = dir->i_sb;
@@ -591,44 +2103,26 @@ struct inode *pram_new_inode(struct inode *dir, umode_t mode,
 	if (!inode)
 		return ERR_PTR(-ENOMEM);
 
-	mutex_lock(&PRAM_SB(sb)->s_lock);
-	ps = pram_get_super(sb);
-
-	if (ps->s_free_inodes_count) {
-		/* find the oldest unused pram inode */
-		for (i = be32_to_cpu(ps->s_free_inode_hint);
-		     i < be32_to_cpu(ps->s_inodes_count); i++) {
-			ino = PRAM_ROOT_INO + (i << PRAM_INODE_BITS);
-			pi = pram_get_inode(sb, ino);
-			/* check if the inode is active. */
-			if (be16_to_cpu(pi->i_links_count) == 0 &&
-			   (be16_to_cpu(pi->i_mode) == 0 ||
-			   be32_to_cpu(pi->i_dtime))) {
-				/* this inode is deleted */
-				break;
-			}
-		}
-
-		if (unlikely(i >= be32_to_cpu(ps->s_inodes_count))) {
-			pram_err(sb, "free inodes count!=0 but none free!?\n");
-			errval = -ENOSPC;
-			goto fail1;
-		}
-
-		pram_dbg("allocating inode %lu\n", ino);
-	} else {
-		pram_dbg("no space left to create new inode!\n");
-		errval = -ENOSPC;
-		goto fail1;
-	}
-
 	diri = pram_get_inode(sb, dir->i_ino);
 	if (!diri) {
 		errval = -EACCES;
 		goto fail1;
 	}
 
+	while ((inode_nr = pram_alloc_inode_nr(sb, dir, mode)) < 0) {
+		/* the inode table is full, try to grow it */
+		errval = pram_grow_inode_table(sb);
+		if (errval) {
+			pram_dbg("no space left to create new inode!\n");
+			goto fail1;
+		}
+	}
+
 	/* chosen inode is in ino */
+	ino = pram_inode_nr_to_ino(sb, inode_nr);
+	pi = pram_get_inode(sb, ino);
+	pram_dbg("allocating inode %lu\n", ino);
+
 	inode->i_ino = ino;
 	inode_init_owner(inode, dir, mode);
 	inode->i_blocks = inode->i_size = 0;
@@ -636,19 +2130,29 @@ struct inode *pram_new_inode(struct inode *dir, umode_t mode,
 
 	inode->i_generation = atomic_add_return(1, &sbi->next_generation);
 
+	if (insert_inode_locked(inode) < 0) {
+		pram_release_inode_nr(sb, inode_nr, S_ISDIR(mode));
+		errval = -EINVAL;
+		goto fail1;
+	}
+
+	/* from now on a failure frees the inode through evict */
 	pram_memunlock_inode(sb, pi);
 	pi->i_d.d_next = 0;
 	pi->i_d.d_prev = 0;
 	pi->i_dtime = 0;
 	pi->i_flags = pram_mask_flags(mode, diri->i_flags);
+	memset(&pi->i_type, 0, sizeof(pi->i_type));
+	/* xip maps the data blocks, the inline data have none */
+	if (((S_ISREG(mode) && !test_opt(sb, XIP)) || S_ISLNK(mode)) &&
+	    test_opt(sb, INLINE_DATA))
+		pi->i_flags |= cpu_to_be32(PRAM_INLINE_DATA_FL);
+	else
+		pi->i_flags |= cpu_to_be32(pram_block_map_flags(sb, mode));
 	pram_memlock_inode(sb, pi);
 
 	pram_set_inode_flags(inode, pi);
 
-	if (insert_inode_locked(inode) < 0) {
-		errval = -EINVAL;
-		goto fail1;
-	}
 	errval = pram_write_inode(inode, NULL);
 	if (errval)
 		goto fail2;
@@ -661,25 +2165,13 @@ struct inode *pram_new_inode(struct inode *dir, umode_t mode,
 	if (errval)
 		goto fail2;
 
-	pram_memunlock_super(sb, ps);
-	be32_add_cpu(&ps->s_free_inodes_count, -1);
-	if (i < be32_to_cpu(ps->s_inodes_count)-1)
-		ps->s_free_inode_hint = cpu_to_be32(i+1);
-	else
-		ps->s_free_inode_hint = 0;
-	pram_memlock_super(sb, ps);
-
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
-
 	return inode;
 fail2:
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
 	clear_nlink(inode);
 	unlock_new_inode(inode);
 	iput(inode);
 	return ERR_PTR(errval);
 fail1:
-	mutex_unlock(&PRAM_SB(sb)->s_lock);
 	make_bad_inode(inode);
 	iput(inode);
 	return ERR_PTR(errval);
@@ -704,6 +2196,7 @@ static int pram_readpage(struct file *file, struct page *page)
 	struct super_block *sb = inode->i_sb;
 	loff_t offset, size;
 	unsigned long fillsize, blocknr, bytes_filled;
+	u8 data[PRAM_INLINE_DATA_SIZE];
 	u64 block;
 	void *buf, *bp;
 	int ret;
@@ -718,13 +2211,22 @@ static int pram_readpage(struct file *file, struct page *page)
 	fillsize = 0;
 	bytes_filled = 0;
 	ret = 0;
-	if (offset < size) {
+	if (pram_get_inline_data(inode, data)) {
+		/* only the first page has data */
+		if (!offset)
+			bytes_filled = min_t(loff_t, size,
+					     PRAM_INLINE_DATA_SIZE);
+		memcpy(buf, data, bytes_filled);
+	} else if (offset < size) {
 		size -= offset;
 		fillsize = size > PAGE_SIZE ? PAGE_SIZE : size;
 		while (fillsize) {
-			int count = fillsize > sb->s_blocksize ?
-						sb->s_blocksize : fillsize;
-			block = pram_find_data_block(inode, blocknr);
+			unsigned long count, run;
+
+			run = pram_find_data_blocks(inode, blocknr,
+					(fillsize + sb->s_blocksize - 1) >>
+					sb->s_blocksize_bits, &block);
+			count = min(run << sb->s_blocksize_bits, fillsize);
 			if (likely(block)) {
 				bp = pram_get_block(sb, block);
 				if (!bp) {
@@ -739,7 +2241,7 @@ static int pram_readpage(struct file *file, struct page *page)
 			}
 			bytes_filled += count;
 			fillsize -= count;
-			blocknr++;
+			blocknr += run;
 		}
 	}
  out:
@@ -785,9 +2287,8 @@ static int pram_block_truncate_page(struct inode *inode, loff_t newsize)
 		ret = -EACCES;
 		goto out;
 	}
-	pram_memunlock_block(sb, bp);
-	memset(bp + offset, 0, length);
-	pram_memlock_block(sb, bp);
+	pram_memzero(pram_memunlock_data(sb, bp + offset, length), length);
+	pram_memlock_data(sb, bp + offset, length);
 out:
 	return ret;
 }
@@ -820,6 +2321,7 @@ static int pram_setsize(struct inode *inode, loff_t newsize)
 	 */
 	synchronize_rcu();
 	truncate_pagecache(inode, newsize);
+	pram_discard_prealloc(inode);
 	__pram_truncate_blocks(inode, newsize, oldsize);
 	/* Check for the flag EOFBLOCKS is still valid after the set size */
 	check_eof_blocks(inode, newsize);
@@ -119,8 +119,13 @@ static struct dentry *pram_lookup(struct inode *dir, struct dentry *dentry,
 static int pram_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 		       bool flags)
 {
-	struct inode *inode = pram_new_inode(dir, mode, &dentry->d_name);
-	int err = PTR_ERR(inode);
+	struct pram_wp_batch batch;
+	struct inode *inode;
+	int err;
+
+	pram_wp_batch_begin(dir->i_sb, &batch);
+	inode = pram_new_inode(dir, mode, &dentry->d_name);
+	err = PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
 		inode->i_op = &pram_file_inode_operations;
 		if (pram_use_xip(inode->i_sb)) {
@@ -132,12 +137,18 @@ static int pram_create(struct inode *dir, struct dentry *dentry, umode_t mode,
 		}
 		err = pram_add_nondir(dir, dentry, inode);
 	}
+	pram_wp_batch_end(&batch);
 	return err;
 }
 
 static int pram_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
-	struct inode *inode = pram_new_inode(dir, mode, NULL);
+	struct pram_wp_batch batch;
+	struct inode *inode;
+
+	pram_wp_batch_begin(dir->i_sb, &batch);
+	inode = pram_new_inode(dir, mode, NULL);
+	pram_wp_batch_end(&batch);
 	if (IS_ERR(inode))
 		return PTR_ERR(inode);
 
@@ -157,14 +168,20 @@ static int pram_tmpfile(struct inode *dir, struct dentry *dentry, umode_t mode)
 static int pram_mknod(struct inode *dir, struct dentry *dentry, umode_t mode,
 		      dev_t rdev)
 {
-	struct inode *inode = pram_new_inode(dir, mode, &dentry->d_name);
-	int err = PTR_ERR(inode);
+	struct pram_wp_batch batch;
+	struct inode *inode;
+	int err;
+
+	pram_wp_batch_begin(dir->i_sb, &batch);
+	inode = pram_new_inode(dir, mode, &dentry->d_name);
+	err = PTR_ERR(inode);
 	if (!IS_ERR(inode)) {
 		init_special_inode(inode, mode, rdev);
 		inode->i_op = &pram_special_inode_operations;
 		pram_write_inode(inode, NULL); /* update rdev */
 		err = pram_add_nondir(dir, dentry, inode);
 	}
+	pram_wp_batch_end(&batch);
 	return err;
 }
 
@@ -172,13 +189,15 @@ static int pram_symlink(struct inode *dir, struct dentry *dentry,
 			const char *symname)
 {
 	struct super_block *sb = dir->i_sb;
+	struct pram_wp_batch batch;
 	int err = -ENAMETOOLONG;
 	unsigned len = strlen(symname);
 	struct inode *inode;
 
 	if (len+1 > sb->s_blocksize)
-		goto out;
+		return err;
 
+	pram_wp_batch_begin(sb, &batch);
 	inode = pram_new_inode(dir, S_IFLNK | S_IRWXUGO, &dentry->d_name);
 	err = PTR_ERR(inode);
 	if (IS_ERR(inode))
@@ -196,6 +215,7 @@ static int pram_symlink(struct inode *dir, struct dentry *dentry,
 
 	err = pram_add_nondir(dir, dentry, inode);
 out:
+	pram_wp_batch_end(&batch);
 	return err;
 
 out_fail:
@@ -215,17 +235,23 @@ static int pram_link(struct dentry *dest_dentry, struct inode *dir,
 static int pram_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = dentry->d_inode;
+	struct pram_wp_batch batch;
+
+	pram_wp_batch_begin(dir->i_sb, &batch);
 	inode->i_ctime = dir->i_ctime;
 	pram_dec_count(inode);
+	pram_wp_batch_end(&batch);
 	return 0;
 }
 
 static int pram_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 {
+	struct pram_wp_batch batch;
 	struct inode *inode;
 	struct pram_inode *pi;
 	int err = 0;
 
+	pram_wp_batch_begin(dir->i_sb, &batch);
 	pram_inc_count(dir);
 
 	inode = pram_new_inode(dir, S_IFDIR | mode, &dentry->d_name);
@@ -252,6 +278,7 @@ static int pram_mkdir(struct inode *dir, struct dentry *dentry, umode_t mode)
 	unlock_new_inode(inode);
 	d_instantiate(dentry, inode);
 out:
+	pram_wp_batch_end(&batch);
 	return err;
 
 out_fail:
@@ -267,6 +294,7 @@ out_dir:
 static int pram_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = dentry->d_inode;
+	struct pram_wp_batch batch;
 	struct pram_inode *pi;
 	int err = -ENOTEMPTY;
 
@@ -277,11 +305,13 @@ static int pram_rmdir(struct inode *dir, struct dentry *dentry)
 
 	/* directory to delete is empty? */
 	if (pi->i_type.dir.tail == 0) {
+		pram_wp_batch_begin(dir->i_sb, &batch);
 		inode->i_ctime = dir->i_ctime;
 		inode->i_size = 0;
 		clear_nlink(inode);
 		pram_write_inode(inode, NULL);
 		pram_dec_count(dir);
+		pram_wp_batch_end(&batch);
 		err = 0;
 	} else {
 		pram_dbg("dir not empty\n");
@@ -297,9 +327,11 @@ static int pram_rename(struct inode  *old_dir,
 {
 	struct inode *old_inode = old_dentry->d_inode;
 	struct inode *new_inode = new_dentry->d_inode;
+	struct pram_wp_batch batch;
 	struct pram_inode *pi_new;
 	int err = -ENOENT;
 
+	pram_wp_batch_begin(old_dir->i_sb, &batch);
 	if (new_inode) {
 		err = -ENOTEMPTY;
 		pi_new = pram_get_inode(new_dir->i_sb, new_inode->i_ino);
@@ -331,6 +363,7 @@ static int pram_rename(struct inode  *old_dir,
 
 	err = 0;
  out:
+	pram_wp_batch_end(&batch);
 	return err;
 }
 
@@ -0,0 +1,124 @@
+/*
+ * BRIEF DESCRIPTION
+ *
+ * Non-temporal store helpers.
+ *
+ * Plain stores pull the destination lines into the CPU caches, evicting
+ * useful data only to write them back later. The memory of pramfs is
+ * rarely read right after it's been written, so it's better to bypass
+ * the caches when it's filled in bulk.
+ *
+ * This file is licensed under the terms of the GNU General Public
+ * License version 2. This program is licensed "as is" without any
+ * warranty of any kind, whether express or implied.
+ */
+
+#ifndef __NTSTORE_H
+#define __NTSTORE_H
+
+#include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/io.h>
+#include <asm/barrier.h>
+#ifdef CONFIG_X86
+#include <asm/processor.h>
+#include <asm/special_insns.h>
+#endif
+
+/*
+ * Below this size the streaming stores don't pay off: the fence after them
+ * costs more than the cache misses saved, and the lines are likely to be
+ * read again soon, e.g. by small appends. See test/ntbench.c.
+ */
+#define PRAM_NT_THRESHOLD	4096
+
+#ifdef CONFIG_X86_64
+/*
+ * Zero len bytes at dst with non-temporal stores. dst and len must be
+ * multiple of 8.
+ */
+static inline void pram_zero_nt(void *dst, size_t len)
+{
+	unsigned long *p = dst;
+	size_t n = len >> 3;
+
+	for (; n >= 4; n -= 4, p += 4)
+		asm volatile("movnti %1, (%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)\n\t"
+			     : : "r" (p), "r" (0UL) : "memory");
+	for (; n; n--, p++)
+		asm volatile("movnti %1, (%0)" : : "r" (p), "r" (0UL)
+			     : "memory");
+
+	/* the non-temporal stores are weakly ordered */
+	wmb();
+}
+#else
+static inline void pram_zero_nt(void *dst, size_t len)
+{
+	memset(dst, 0, len);
+}
+#endif
+
+/*
+ * Zero len bytes of pramfs memory, with non-temporal stores if the range
+ * is big enough. The unaligned head and tail are zeroed with memset.
+ */
+static inline void pram_memzero(void *dst, size_t len)
+{
+	size_t head, body;
+
+	if (len < PRAM_NT_THRESHOLD) {
+		memset(dst, 0, len);
+		return;
+	}
+
+	head = PTR_ALIGN(dst, 8) - dst;
+	body = (len - head) & ~7UL;
+	memset(dst, 0, head);
+	pram_zero_nt(dst + head, body);
+	memset(dst + head + body, 0, len - head - body);
+}
+
+/*
+ * Copy len bytes from userspace to pramfs memory, with non-temporal
+ * stores if the copy is big enough. It returns the number of bytes not
+ * copied. It can run in a write window with the page faults disabled,
+ * then a page not present stops the copy instead of being faulted in.
+ */
+static inline unsigned long pram_copy_from_user(void *dst,
+						const void __user *src,
+						unsigned long len)
+{
+	if (len >= PRAM_NT_THRESHOLD)
+		return __copy_from_user_inatomic_nocache(dst, src, len);
+	return __copy_from_user_inatomic(dst, src, len);
+}
+
+#ifdef CONFIG_X86
+/*
+ * The protected mounts map the memory write-back (pram_ioremap_wp), so
+ * the stores stay in the CPU caches until they're written back: the lines
+ * of [p, p + len) are flushed to memory, and the fences order the flush
+ * after the stores before it and before anything written afterwards.
+ */
+static inline void pram_flush_range(void *p, unsigned long len)
+{
+	unsigned long size = boot_cpu_data.x86_clflush_size;
+	void *end = p + len;
+
+	mb();
+	for (p = (void *)((unsigned long)p & ~(size - 1)); p < end; p += size)
+		clflush(p);
+	mb();
+}
+#define pram_ioremap_wp(addr, size)	ioremap_cache(addr, size)
+#else
+/* Without a way to write back the caches the memory isn't cached at all */
+static inline void pram_flush_range(void *p, unsigned long len) {}
+#define pram_ioremap_wp(addr, size)	ioremap_nocache(addr, size)
+#endif
+
+#endif	/* __NTSTORE_H */
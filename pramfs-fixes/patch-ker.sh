@@ -159,7 +159,7 @@ else
    cp $PWD/Kconfig $LINUXDIR/fs/pramfs
    cp $PWD/pramfs.txt $LINUXDIR/Documentation/filesystems/pramfs.txt
    cp $PWD/*.c $LINUXDIR/fs/pramfs
-   cp $PWD/acl.h $PWD/xattr.h $PWD/desctree.h $PWD/pram.h $PWD/wprotect.h $PWD/xip.h $LINUXDIR/fs/pramfs
+   cp $PWD/acl.h $PWD/xattr.h $PWD/desctree.h $PWD/extents.h $PWD/freetree.h $PWD/ntstore.h $PWD/pram.h $PWD/wprotect.h $PWD/xip.h $LINUXDIR/fs/pramfs
    cp $PWD/pram_fs.h $LINUXDIR/include/linux
    cp $PWD/pram_fs_uapi.h $LINUXDIR/include/uapi/linux/pram_fs.h
 fi
@@ -18,7 +18,10 @@
 #include <linux/pram_fs.h>
 #include <linux/crc32.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
 #include "wprotect.h"
 
@@ -47,6 +50,7 @@ do {                                                                   \
 #define pram_set_bit			__test_and_set_bit_le
 #define pram_clear_bit			__test_and_clear_bit_le
 #define pram_find_next_zero_bit		find_next_zero_bit_le
+#define pram_find_next_bit		find_next_bit_le
 
 #define clear_opt(o, opt)	(o &= ~PRAM_MOUNT_##opt)
 #define set_opt(o, opt)		(o |= PRAM_MOUNT_##opt)
@@ -63,9 +67,41 @@ extern int pram_mmap(struct file *file, struct vm_area_struct *vma);
 
 /* balloc.c */
 extern void pram_init_bitmap(struct super_block *sb);
+extern void pram_rebuild_bitmap(struct super_block *sb);
+extern void pram_reset_alloc_groups(struct super_block *sb,
+				    unsigned long *free);
+extern int pram_init_alloc_groups(struct super_block *sb,
+				  unsigned long *free);
+extern void pram_destroy_alloc_groups(struct super_block *sb);
+extern unsigned long pram_first_free_block(struct super_block *sb);
+extern int pram_init_blk_pools(struct super_block *sb);
+extern void pram_destroy_blk_pools(struct super_block *sb);
+extern unsigned long pram_drain_blk_pools(struct super_block *sb);
+extern int pram_start_zerod(struct super_block *sb);
+extern void pram_stop_zerod(struct super_block *sb);
+extern unsigned long pram_drain_zero_pool(struct super_block *sb);
 extern void pram_free_block(struct super_block *sb, unsigned long blocknr);
+extern void pram_free_batch_add(struct super_block *sb,
+				struct pram_free_batch *batch,
+				unsigned long blocknr);
+extern void pram_free_batch_flush(struct super_block *sb,
+				  struct pram_free_batch *batch);
 extern int pram_new_block(struct super_block *sb, unsigned long *blocknr,
 			  int zero);
+extern int pram_new_blocks(struct super_block *sb, unsigned long goal,
+			   unsigned long want, unsigned long *start,
+			   unsigned long *got, int zero);
+extern int pram_new_blocks_exact(struct super_block *sb, unsigned long goal,
+				 unsigned long want, unsigned long *start);
+extern int pram_new_huge_blocks(struct super_block *sb, unsigned long goal,
+				unsigned long *start);
+extern unsigned long pram_prealloc_take(struct inode *inode,
+				       unsigned long iblock, unsigned long want,
+				       unsigned long *start);
+extern void pram_prealloc_set(struct inode *inode, unsigned long iblock,
+			      unsigned long start, unsigned long len);
+extern void pram_discard_prealloc(struct inode *inode);
+extern unsigned long pram_discard_all_prealloc(struct super_block *sb);
 extern unsigned long pram_count_free_blocks(struct super_block *sb);
 
 /* dir.c */
@@ -80,10 +116,25 @@ extern int pram_alloc_blocks(struct inode *inode, int file_blocknr,
 			     unsigned int num);
 extern u64 pram_find_data_block(struct inode *inode,
 				unsigned long file_blocknr);
+extern unsigned long pram_find_data_blocks(struct inode *inode,
+					   unsigned long file_blocknr,
+					   unsigned long count, u64 *block);
+extern void pram_map_cache_invalidate(struct inode *inode);
+extern int pram_get_inline_data(struct inode *inode, void *buf);
+extern int pram_unpack_inline_data(struct inode *inode);
 
 extern struct inode *pram_iget(struct super_block *sb, unsigned long ino);
 extern void pram_put_inode(struct inode *inode);
 extern void pram_evict_inode(struct inode *inode);
+extern ino_t pram_inode_nr_to_ino(struct super_block *sb,
+				  unsigned long inode_nr);
+extern long pram_ino_to_nr(struct super_block *sb, u64 ino);
+extern void pram_release_inode_nr(struct super_block *sb,
+				  unsigned long inode_nr, int dir);
+extern unsigned long pram_free_inode_hint(struct super_block *sb);
+extern int pram_init_inode_alloc(struct super_block *sb,
+				 unsigned long *free);
+extern void pram_destroy_inode_alloc(struct super_block *sb);
 extern struct inode *pram_new_inode(struct inode *dir, umode_t mode,
 					const struct qstr *qstr);
 extern int pram_update_inode(struct inode *inode);
@@ -109,6 +160,7 @@ extern struct super_block *pram_read_super(struct super_block *sb,
 					      void *data,
 					      int silent);
 extern int pram_statfs(struct dentry *d, struct kstatfs *buf);
+extern void pram_checkpoint(struct super_block *sb, int clean);
 extern int pram_remount(struct super_block *sb, int *flags, char *data);
 
 /* symlink.c */
@@ -116,6 +168,7 @@ extern int pram_block_symlink(struct inode *inode,
 			       const char *symname, int len);
 
 /* Inline functions start here */
+
 static inline int pram_freeze_fs(struct super_block *sb)
 {
 	return 0;
@@ -148,6 +201,127 @@ static inline int pram_calc_checksum(u8 *data, int n)
 		return 1;
 }
 
+/*
+ * Per-CPU cache of blocks already claimed in the bitmap (see balloc.c).
+ * PRAM_POOL_SIZE must be at least twice PRAM_POOL_BATCH.
+ */
+#define PRAM_POOL_BATCH	32	/* blocks moved from/to the bitmap at once */
+#define PRAM_POOL_SIZE	64	/* max blocks cached per CPU */
+
+struct pram_blk_pool {
+	spinlock_t lock;
+	unsigned int count;
+	unsigned long blocks[PRAM_POOL_SIZE];
+};
+
+/*
+ * Pool of free blocks zeroed in background by a kernel thread (see
+ * balloc.c), kept as runs of contiguous blocks.
+ */
+#define PRAM_ZERO_RUNS		16	/* max runs in the pool */
+#define PRAM_ZERO_RUN_LEN	64	/* blocks zeroed at once */
+/* refill only while there are more free blocks than this */
+#define PRAM_ZERO_RESERVE	(4 * PRAM_ZERO_RUNS * PRAM_ZERO_RUN_LEN)
+
+struct pram_zero_run {
+	unsigned long start;
+	unsigned long len;
+};
+
+struct pram_zero_pool {
+	spinlock_t lock;
+	unsigned int nr;		/* runs in the pool */
+	struct pram_zero_run run[PRAM_ZERO_RUNS];
+	struct task_struct *thread;
+};
+
+/*
+ * Allocation groups (see balloc.c). The in-use bits of a group fill one
+ * page of the bitmap.
+ */
+#define PRAM_GROUP_SHIFT	(PAGE_SHIFT + 3)
+
+struct pram_alloc_group {
+	struct mutex lock;
+	struct rb_root free_tree;	/* free runs of the group */
+	unsigned long start;		/* first block of the group */
+	unsigned long end;		/* last block of the group + 1 */
+	unsigned long free;		/* free blocks in the group */
+	unsigned long hint;		/* where to try the next allocation */
+};
+
+/*
+ * Inode groups (see inode.c). Each one is a range of slots of the inode
+ * table with its own counters and cursor.
+ */
+#define PRAM_INODE_GROUP_MIN	512	/* min slots per group */
+
+struct pram_inode_group {
+	unsigned long start;		/* first slot of the group */
+	unsigned long end;		/* last slot of the group + 1 */
+	unsigned long hint;		/* where to search a free slot */
+	atomic_long_t free;		/* free slots in the group */
+	atomic_t dirs;			/* directories in the group */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * DRAM copy of the map of the inode table chunks (see inode.c), replaced
+ * under RCU.
+ */
+struct pram_inode_chunks {
+	struct rcu_head rcu;
+	unsigned int count;		/* chunks in the table */
+	unsigned long *block;		/* first block of each chunk */
+	unsigned int *sorted;		/* chunks sorted by first block */
+};
+
+/*
+ * Size bounds of the preallocation windows of the files (see balloc.c),
+ * in blocks. In between, a window is as long as the file.
+ */
+#define PRAM_PREALLOC_MIN	8
+#define PRAM_PREALLOC_MAX	256
+
+/*
+ * Blocks being freed, gathered in runs of contiguous blocks so that the
+ * bitmap is updated a run at a time, taking the group locks once.
+ */
+#define PRAM_FREE_BATCH	16	/* max runs in a batch */
+
+struct pram_free_batch {
+	unsigned int nr;	/* number of runs */
+	unsigned long count;	/* number of blocks */
+	struct {
+		unsigned long start;
+		unsigned long len;
+	} run[PRAM_FREE_BATCH];
+};
+
+static inline void pram_init_free_batch(struct pram_free_batch *batch)
+{
+	batch->nr = 0;
+	batch->count = 0;
+}
+
+/* A batch that may have to be flushed by the next pram_free_batch_add() */
+static inline int pram_free_batch_full(struct pram_free_batch *batch)
+{
+	return batch->nr == PRAM_FREE_BATCH;
+}
+
+/*
+ * DRAM cache of the recent translations of the file blocks of an inode,
+ * in runs of blocks contiguous both in the file and in memory (see
+ * pram_find_data_block()).
+ */
+#define PRAM_MAP_CACHE_RUNS	8
+
+struct pram_map_run {
+	unsigned long lblk;	/* first file block */
+	unsigned long pblk;	/* first data block, absolute blocknr */
+	unsigned long len;	/* number of blocks, zero if unused */
+};
+
 struct pram_inode_vfs {
 #ifdef CONFIG_PRAMFS_XATTR
 	/*
@@ -161,6 +335,28 @@ struct pram_inode_vfs {
 #endif
 	struct mutex i_meta_mutex;
 	struct mutex i_link_mutex;
+	/*
+	 * Preallocation window: blocks reserved for the next appends,
+	 * right after the last block of the file. They are in use in the
+	 * bitmap but not accounted to the inode.
+	 */
+	spinlock_t i_prealloc_lock;
+	unsigned long i_prealloc_iblock;	/* file block it starts at */
+	unsigned long i_prealloc_start;		/* first reserved block */
+	unsigned long i_prealloc_len;		/* number of reserved blocks */
+	struct list_head i_prealloc_list;	/* in s_prealloc_list */
+	/*
+	 * Extent tree updates, see extents.c. i_ext_seq also covers the
+	 * moves of the direct pointers and of the inline data to blocks.
+	 */
+	struct mutex i_ext_mutex;
+	seqcount_t i_ext_seq;
+	/* Mapping cache, i_map_lock serializes the updates */
+	spinlock_t i_map_lock;
+	seqcount_t i_map_seq;
+	unsigned int i_map_gen;		/* bumped by every invalidation */
+	unsigned int i_map_next;	/* next run to replace */
+	struct pram_map_run i_map[PRAM_MAP_CACHE_RUNS];
 	struct inode vfs_inode;
 };
 
@@ -190,6 +386,63 @@ pram_get_redund_super(struct super_block *sb)
 	return (struct pram_super_block *)(sbi->virt_addr + PRAM_SB_SIZE);
 }
 
+/*
+ * The block counts of the super block, the high 32 bits are used only
+ * with PRAM_FEATURE_INCOMPAT_64BIT.
+ */
+static inline int pram_has_64bit(struct pram_super_block *ps)
+{
+	return ps->s_feature_incompat &
+		cpu_to_be32(PRAM_FEATURE_INCOMPAT_64BIT);
+}
+
+static inline unsigned long pram_blocks_count(struct pram_super_block *ps)
+{
+	u64 count = be32_to_cpu(ps->s_blocks_count);
+
+	if (pram_has_64bit(ps))
+		count |= (u64)be32_to_cpu(ps->s_blocks_count_hi) << 32;
+	return count;
+}
+
+static inline void pram_set_blocks_count(struct pram_super_block *ps,
+					 unsigned long count)
+{
+	ps->s_blocks_count = cpu_to_be32(count);
+	if (pram_has_64bit(ps))
+		ps->s_blocks_count_hi = cpu_to_be32((u64)count >> 32);
+}
+
+static inline void pram_set_free_blocks_count(struct pram_super_block *ps,
+					      unsigned long count)
+{
+	ps->s_free_blocks_count = cpu_to_be32(count);
+	if (pram_has_64bit(ps))
+		ps->s_free_blocks_count_hi = cpu_to_be32((u64)count >> 32);
+}
+
+/*
+ * The size of pi. With PRAM_FEATURE_INCOMPAT_64BIT its high 32 bits take
+ * the place of i_dtime, that matters only once the inode is deleted.
+ */
+static inline loff_t pram_inode_size(struct super_block *sb,
+				     struct pram_inode *pi)
+{
+	loff_t size = be32_to_cpu(pi->i_size);
+
+	if (test_opt(sb, 64BIT))
+		size |= (loff_t)be32_to_cpu(pi->i_size_high) << 32;
+	return size;
+}
+
+static inline void pram_set_inode_size(struct super_block *sb,
+				       struct pram_inode *pi, loff_t size)
+{
+	pi->i_size = cpu_to_be32(size);
+	if (test_opt(sb, 64BIT))
+		pi->i_size_high = cpu_to_be32((u64)size >> 32);
+}
+
 static inline void *
 pram_get_bitmap(struct super_block *sb)
 {
@@ -238,12 +491,110 @@ pram_get_block(struct super_block *sb, u64 block)
 	return block ? ((void *)ps + block) : NULL;
 }
 
+/*
+ * Address to write the file data at p, a pointer in the filesystem memory:
+ * with protect=metadata it's in the writable alias of the memory, and the
+ * writes need no window. The metadata are only written through virt_addr.
+ */
+static inline void *pram_data_alias(struct super_block *sb, void *p)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	if (!sbi->data_addr)
+		return p;
+	return sbi->data_addr + (p - sbi->virt_addr);
+}
+
+/*
+ * Open a write window on len bytes of file data at p, returning where to
+ * write them: with protect=metadata the alias, and nothing to unlock,
+ * otherwise the window of pram_memunlock_alias().
+ */
+static inline void *pram_memunlock_data(struct super_block *sb, void *p,
+					unsigned long len)
+{
+	if (PRAM_SB(sb)->data_addr)
+		return pram_data_alias(sb, p);
+	return pram_memunlock_alias(sb, p, len);
+}
+
+static inline void pram_memlock_data(struct super_block *sb, void *p,
+				     unsigned long len)
+{
+	/* the alias is cached as well, see __pram_memlock_range() */
+	if (PRAM_SB(sb)->data_addr)
+		pram_flush_range(pram_data_alias(sb, p), len);
+	else
+		pram_memlock_alias(sb, p, len);
+}
+
+/* The data blocks of pi are pointed by the inode, not by block arrays */
+static inline int pram_has_direct(struct pram_inode *pi)
+{
+	return pi->i_flags & cpu_to_be32(PRAM_DIRECT_FL);
+}
+
+/*
+ * Index levels above the row block in the block arrays of pi, they are
+ * added only with PRAM_FEATURE_INCOMPAT_64BIT.
+ */
+static inline unsigned int pram_tree_height(struct super_block *sb,
+					    struct pram_inode *pi)
+{
+	return test_opt(sb, 64BIT) ? pi->i_type.reg.height : 0;
+}
+
+/* The block arrays of the given height map the file block iblock */
+static inline int pram_tree_covers(struct super_block *sb,
+				   unsigned int height, unsigned long iblock)
+{
+	unsigned int shift = (height + 2) * (sb->s_blocksize_bits - 3);
+
+	return shift >= BITS_PER_LONG || !(iblock >> shift);
+}
+
+/* The data of pi are stored in the inode, it has no data blocks */
+static inline int pram_has_inline_data(struct pram_inode *pi)
+{
+	return pi->i_flags & cpu_to_be32(PRAM_INLINE_DATA_FL);
+}
+
 static inline unsigned long
 pram_get_pfn(struct super_block *sb, u64 block)
 {
 	return (PRAM_SB(sb)->phys_addr + block) >> PAGE_SHIFT;
 }
 
+/* Data blocks in a huge page, the unit of the xip_huge allocations */
+static inline unsigned long pram_huge_blocks(struct super_block *sb)
+{
+	return PMD_SIZE >> sb->s_blocksize_bits;
+}
+
+/* A pram inode is free when it has no links and it's either never been
+   used or deleted */
+static inline int pram_inode_is_free(struct pram_inode *pi)
+{
+	return be16_to_cpu(pi->i_links_count) == 0 &&
+	       (be16_to_cpu(pi->i_mode) == 0 || be32_to_cpu(pi->i_dtime));
+}
+
+/* Max delay before the free counters are written back to the super block */
+#define PRAM_CHECKPOINT_INTERVAL	(5 * HZ)
+
+/*
+ * The free counters have changed: make sure that they reach the super
+ * block within PRAM_CHECKPOINT_INTERVAL.
+ */
+static inline void pram_dirty_counters(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	if (!delayed_work_pending(&sbi->s_checkpoint_work))
+		schedule_delayed_work(&sbi->s_checkpoint_work,
+				      PRAM_CHECKPOINT_INTERVAL);
+}
+
 static inline void check_eof_blocks(struct inode *inode, loff_t size)
 {
 	struct pram_inode *pi = pram_get_inode(inode->i_sb, inode->i_ino);
@@ -15,8 +15,20 @@
 #ifndef _LINUX_PRAM_FS_H
 #define _LINUX_PRAM_FS_H
 
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/hashtable.h>
+#include <linux/mempool.h>
 #include <uapi/linux/pram_fs.h>
 
+struct pram_blk_pool;
+struct pram_alloc_group;
+struct pram_zero_pool;
+struct pram_inode_group;
+struct pram_inode_chunks;
+
+#define PRAM_WP_HASH_BITS	6
+
 /*
  * PRAM filesystem super-block data in memory
  */
@@ -27,6 +39,8 @@ struct pram_sb_info {
 	 */
 	phys_addr_t phys_addr;
 	void *virt_addr;
+	/* writable alias of virt_addr for the file data, protect=metadata */
+	void *data_addr;
 
 	/* Mount options */
 	unsigned long bpi;
@@ -43,6 +57,52 @@ struct pram_sb_info {
 	spinlock_t desc_tree_lock;
 #endif
 	struct mutex s_lock;
+#if defined(CONFIG_PRAMFS_WRITE_PROTECT) && \
+	!defined(CONFIG_PRAMFS_WRITE_PROTECT_CR0)
+	/* Pages writable in the shared mapping, see pram_wp_get() */
+	spinlock_t s_wp_lock;
+	DECLARE_HASHTABLE(s_wp_pages, PRAM_WP_HASH_BITS);
+	mempool_t *s_wp_pool;
+#endif
+	/* Per-CPU pools of free blocks */
+	struct pram_blk_pool __percpu *s_pool;
+	/* Pool of pre-zeroed free blocks, NULL if read-only */
+	struct pram_zero_pool *s_zero_pool;
+	/* Blocks in the pool, out of it as statfs can race its kfree() */
+	unsigned long s_zero_count;
+	/* Allocation groups of the data blocks */
+	struct pram_alloc_group *s_groups;
+	unsigned int s_groups_count;
+	unsigned long s_group_skew;	/* bitmap offset in its page, in bits */
+	/* Unclean fs mounted read-only, rebuild the bitmap at remount rw */
+	int s_rebuild_pending;
+	/* In-use bitmap of the inode table and inode groups */
+	unsigned long *s_inode_bitmap;
+	struct pram_inode_group *s_inode_groups;
+	unsigned int s_inode_groups_count;
+	unsigned int s_static_groups;		/* groups of the first table */
+	unsigned long s_inode_group_size;	/* slots per group */
+	/* Chunks added to the inode table, s_lock serializes the growth */
+	struct pram_inode_chunks __rcu *s_inode_chunks;
+	unsigned long s_static_inodes;		/* inodes in the first table */
+	unsigned long s_chunk_base;		/* slot of the first chunk */
+	unsigned long s_inodes_count;		/* total inodes */
+	/*
+	 * Free counters. They are written back to the super block only by
+	 * a checkpoint.
+	 */
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct delayed_work s_checkpoint_work;
+	/* Inodes with a preallocation window and the blocks reserved */
+	spinlock_t s_prealloc_lock;
+	struct list_head s_prealloc_list;
+	atomic_long_t s_prealloc_count;
+	/* Lookups of the inode mapping caches */
+	struct percpu_counter s_map_hits;
+	struct percpu_counter s_map_misses;
+	struct proc_dir_entry *s_proc;		/* /proc/fs/pramfs/<addr> */
+	struct super_block *s_sb;		/* back pointer */
 };
 
 #endif	/* _LINUX_PRAM_FS_H */
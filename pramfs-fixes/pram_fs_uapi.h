@@ -32,13 +32,25 @@
 #define PRAM_MOUNT_ERRORS_CONT		0x000010  /* Continue on errors */
 #define PRAM_MOUNT_ERRORS_RO		0x000020  /* Remount fs ro on errors */
 #define PRAM_MOUNT_ERRORS_PANIC		0x000040  /* Panic on errors */
+#define PRAM_MOUNT_XIP_HUGE		0x000080  /* Huge page aligned xip */
+#define PRAM_MOUNT_EXTENTS		0x000100  /* Map new files with extents */
+#define PRAM_MOUNT_DIRECT		0x000200  /* Small files mapped by inode */
+#define PRAM_MOUNT_INLINE_DATA		0x000400  /* Tiny files in the inode */
+#define PRAM_MOUNT_64BIT		0x000800  /* 64 bits sizes and counts */
+#define PRAM_MOUNT_PROTECT_METADATA	0x001000  /* File data not protected */
 
 /*
  * Pram inode flags
  *
  * PRAM_EOFBLOCKS_FL	There are blocks allocated beyond eof
+ * PRAM_EXTENTS_FL	The data blocks are mapped by an extent tree
+ * PRAM_DIRECT_FL	The data blocks are pointed by the inode itself
+ * PRAM_INLINE_DATA_FL	The data are stored in the inode itself
  */
 #define PRAM_EOFBLOCKS_FL	0x20000000
+#define PRAM_DIRECT_FL		0x40000000
+#define PRAM_EXTENTS_FL		FS_EXTENT_FL
+#define PRAM_INLINE_DATA_FL	FS_INLINE_DATA_FL
 /* Flags that should be inherited by new inodes from their parent. */
 #define PRAM_FL_INHERITED (FS_SECRM_FL | FS_UNRM_FL | FS_COMPR_FL |\
 			   FS_SYNC_FL | FS_NODUMP_FL | FS_NOATIME_FL | \
@@ -48,7 +60,9 @@
 #define PRAM_REG_FLMASK (~(FS_DIRSYNC_FL | FS_TOPDIR_FL))
 /* Flags that are appropriate for non-directories/regular files. */
 #define PRAM_OTHER_FLMASK (FS_NODUMP_FL | FS_NOATIME_FL)
-#define PRAM_FL_USER_VISIBLE (FS_FL_USER_VISIBLE | PRAM_EOFBLOCKS_FL)
+#define PRAM_FL_USER_VISIBLE (FS_FL_USER_VISIBLE | PRAM_EOFBLOCKS_FL | \
+			      PRAM_EXTENTS_FL | PRAM_DIRECT_FL | \
+			      PRAM_INLINE_DATA_FL)
 
 /*
  * Maximal count of links to a file
@@ -62,6 +76,21 @@
 #define PRAM_INODE_SIZE 128 /* must be power of two */
 #define PRAM_INODE_BITS   7
 
+/*
+ * File blocks pointed by an inode with PRAM_DIRECT_FL, the block arrays
+ * replace the pointers when the file grows beyond them.
+ */
+#define PRAM_DIRECT_BLOCKS 2
+
+/*
+ * Bytes of data stored in an inode with PRAM_INLINE_DATA_FL, they move
+ * to a data block when the file grows beyond them.
+ */
+#define PRAM_INLINE_DATA_SIZE 16
+
+/* Inodes in a chunk of inode table allocated from the data blocks */
+#define PRAM_INODES_PER_CHUNK 1024
+
 /*
  * Structure of a directory entry in PRAMFS.
  * Offsets are to the inode that holds the referenced dentry.
@@ -74,6 +103,37 @@ struct pram_dentry {
 };
 
 
+/*
+ * Extent tree. A run of len data blocks of a file is mapped by a single
+ * record, the blocks are addressed by offset as in the block arrays.
+ * The inode holds one record: with ee_len set it's the only extent of
+ * the file, otherwise ee_start is the root node of the tree, if any.
+ * A node is a block starting with a header, followed by the records
+ * sorted by first file block: extents in the leaves, pointers to the
+ * nodes of the level below in the index nodes.
+ */
+#define PRAM_EXTENT_MAGIC	0x7078
+
+struct pram_extent_header {
+	__be16	eh_magic;	/* PRAM_EXTENT_MAGIC */
+	__be16	eh_entries;	/* number of records */
+	__be16	eh_max;		/* capacity of the node */
+	__be16	eh_depth;	/* zero for the leaves */
+	__be64	eh_reserved;
+};
+
+struct pram_extent {
+	__be32	ee_block;	/* first file block */
+	__be32	ee_len;		/* number of blocks */
+	__be64	ee_start;	/* offset of the first data block */
+};
+
+struct pram_extent_idx {
+	__be32	ei_block;	/* first file block of the subtree */
+	__be32	ei_unused;
+	__be64	ei_child;	/* offset of the node */
+};
+
 /*
  * Structure of an inode in PRAMFS
  */
@@ -88,7 +148,11 @@ struct pram_inode {
 	__be32	i_atime;	/* Access time */
 	__be32	i_ctime;	/* Creation time */
 	__be32	i_mtime;	/* Modification time */
-	__be32	i_dtime;	/* Deletion Time */
+	union {
+		__be32	i_dtime;	/* Deletion Time */
+		/* with PRAM_FEATURE_INCOMPAT_64BIT, until deleted */
+		__be32	i_size_high;	/* High 32 bits of i_size */
+	};
 	__be64	i_xattr;	/* Extended attribute block */
 	__be32	i_generation;	/* File version (for NFS) */
 	__be32	i_flags;	/* Inode flags */
@@ -97,10 +161,18 @@ struct pram_inode {
 		struct {
 			/*
 			 * ptr to row block of 2D block pointer array,
-			 * file block #'s 0 to (blocksize/8)^2 - 1.
+			 * file block #'s 0 to (blocksize/8)^2 - 1, or
+			 * to the root of height index levels above the
+			 * row blocks, (blocksize/8) times more each.
 			 */
 			__be64 row_block;
+			__u8   height;
 		} reg;   /* regular file or symlink inode */
+		struct pram_extent ext; /* regular file with PRAM_EXTENTS_FL */
+		/* regular file or symlink with PRAM_DIRECT_FL */
+		__be64 direct[PRAM_DIRECT_BLOCKS];
+		/* regular file or symlink with PRAM_INLINE_DATA_FL */
+		__u8 data[PRAM_INLINE_DATA_SIZE];
 		struct {
 			__be64 head; /* first entry in this directory */
 			__be64 tail; /* last entry in this directory */
@@ -138,8 +210,40 @@ struct pram_super_block {
 	__be32	s_wtime;	/* Write time */
 	__be16	s_magic;	/* Magic signature */
 	char	s_volume_name[16]; /* volume name */
+	__be16	s_state;	/* File system state */
+	__be32	s_inode_chunks;	/* inode table chunks added to the table */
+	__be64	s_inode_map;	/* offset of the inode table chunks map */
+	__be32	s_feature_incompat; /* features changing the media format */
+	/* with PRAM_FEATURE_INCOMPAT_64BIT */
+	__be32	s_blocks_count_hi;	/* High 32 bits of s_blocks_count */
+	__be32	s_free_blocks_count_hi;	/* and of s_free_blocks_count */
 };
 
+/*
+ * Super block state
+ *
+ * PRAM_VALID_FS	Unmounted cleanly, the free counters are valid
+ */
+#define PRAM_VALID_FS		0x0001
+
+/*
+ * Incompatible features: a kernel must not mount the filesystem if it
+ * doesn't know all of them.
+ *
+ * PRAM_FEATURE_INCOMPAT_EXTENTS	Regular files may use extent trees
+ * PRAM_FEATURE_INCOMPAT_DIRECT		Small files may be mapped by the inode
+ * PRAM_FEATURE_INCOMPAT_INLINE_DATA	Tiny files may be stored in the inode
+ * PRAM_FEATURE_INCOMPAT_64BIT		64 bits file sizes and block counts
+ */
+#define PRAM_FEATURE_INCOMPAT_EXTENTS	0x0001
+#define PRAM_FEATURE_INCOMPAT_DIRECT	0x0002
+#define PRAM_FEATURE_INCOMPAT_INLINE_DATA	0x0004
+#define PRAM_FEATURE_INCOMPAT_64BIT	0x0008
+#define PRAM_FEATURE_INCOMPAT_SUPP	(PRAM_FEATURE_INCOMPAT_EXTENTS | \
+					 PRAM_FEATURE_INCOMPAT_DIRECT | \
+					 PRAM_FEATURE_INCOMPAT_INLINE_DATA | \
+					 PRAM_FEATURE_INCOMPAT_64BIT)
+
 /* The root inode follows immediately after the redundant super block */
 #define PRAM_ROOT_INO (PRAM_SB_SIZE*2)
 
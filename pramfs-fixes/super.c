@@ -31,7 +31,9 @@
 #include <linux/cred.h>
 #include <linux/backing-dev.h>
 #include <linux/ioport.h>
+#include <linux/proc_fs.h>
 #include "xattr.h"
+#include "freetree.h"
 #include "pram.h"
 
 static struct super_operations pram_sops;
@@ -95,8 +97,12 @@ static inline void *pram_ioremap(phys_addr_t phys_addr, ssize_t size,
 	if (!retval)
 		goto fail;
 
+	/*
+	 * A protected mount writes back the caches when it closes a write
+	 * window, so its memory can be cached.
+	 */
 	if (protect) {
-		retval = (__force void *)ioremap_nocache(phys_addr, size);
+		retval = (__force void *)pram_ioremap_wp(phys_addr, size);
 		if (!retval)
 			goto fail;
 		pram_writeable(retval, size, 0);
@@ -106,10 +112,51 @@ fail:
 	return retval;
 }
 
-static loff_t pram_max_size(int bits)
+/*
+ * With protect=metadata the whole memory is mapped a second time, writable,
+ * and only the file data are written through this alias (see
+ * pram_data_alias()). Same caching as the read-only mapping.
+ */
+static int pram_map_data_alias(struct super_block *sb, ssize_t size)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	if (!test_opt(sb, PROTECT_METADATA))
+		return 0;
+
+	sbi->data_addr = (__force void *)pram_ioremap_wp(sbi->phys_addr, size);
+	if (!sbi->data_addr) {
+		printk(KERN_ERR "ioremap of the pramfs data alias failed\n");
+		return -EINVAL;
+	}
+	return 0;
+}
+
+static void pram_unmap_data_alias(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	if (sbi->data_addr) {
+		iounmap((void __iomem *)sbi->data_addr);
+		sbi->data_addr = NULL;
+	}
+}
+
+static loff_t pram_max_size(int bits, int extents, int is64)
 {
 	loff_t res;
-	res = (1ULL << (3*bits - 6)) - 1;
+
+	/*
+	 * with 64 bits sizes the block arrays grow as needed, the limit
+	 * is the count of blocks of a file in i_blocks and file_blocknr.
+	 */
+	if (is64)
+		res = (1ULL << (31 + bits)) - 1;
+	/* the extents are limited only by the 32 bits i_size */
+	else if (extents)
+		res = 0xffffffffULL;
+	else
+		res = (1ULL << (3*bits - 6)) - 1;
 
 	if (res > MAX_LFS_FILESIZE)
 		res = MAX_LFS_FILESIZE;
@@ -122,8 +169,9 @@ enum {
 	Opt_addr, Opt_bpi, Opt_size,
 	Opt_num_inodes, Opt_mode, Opt_uid,
 	Opt_gid, Opt_blocksize, Opt_user_xattr,
-	Opt_nouser_xattr, Opt_noprotect,
-	Opt_acl, Opt_noacl, Opt_xip,
+	Opt_nouser_xattr, Opt_noprotect, Opt_protect,
+	Opt_acl, Opt_noacl, Opt_xip, Opt_xip_huge, Opt_extents, Opt_direct,
+	Opt_inline_data, Opt_64bit,
 	Opt_err_cont, Opt_err_panic, Opt_err_ro,
 	Opt_err
 };
@@ -140,9 +188,15 @@ static const match_table_t tokens = {
 	{Opt_user_xattr,	"user_xattr"},
 	{Opt_user_xattr,	"nouser_xattr"},
 	{Opt_noprotect,		"noprotect"},
+	{Opt_protect,		"protect=%s"},
 	{Opt_acl,		"acl"},
 	{Opt_acl,		"noacl"},
 	{Opt_xip,		"xip"},
+	{Opt_xip_huge,		"xip_huge"},
+	{Opt_extents,		"extents"},
+	{Opt_direct,		"direct"},
+	{Opt_inline_data,	"inline_data"},
+	{Opt_64bit,		"64bit"},
 	{Opt_err_cont,		"errors=continue"},
 	{Opt_err_panic,		"errors=panic"},
 	{Opt_err_ro,		"errors=remount-ro"},
@@ -282,6 +336,22 @@ static int pram_parse_options(char *options, struct pram_sb_info *sbi,
 			if (remount)
 				goto bad_opt;
 			clear_opt(sbi->s_mount_opt, PROTECT);
+			clear_opt(sbi->s_mount_opt, PROTECT_METADATA);
+#endif
+			break;
+		case Opt_protect:
+#ifdef CONFIG_PRAMFS_WRITE_PROTECT
+			if (remount)
+				goto bad_opt;
+			if (!strcmp(args[0].from, "all"))
+				clear_opt(sbi->s_mount_opt, PROTECT_METADATA);
+			else if (!strcmp(args[0].from, "metadata"))
+				set_opt(sbi->s_mount_opt, PROTECT_METADATA);
+			else
+				goto bad_val;
+			set_opt(sbi->s_mount_opt, PROTECT);
+#else
+			pram_info("protect option not supported\n");
 #endif
 			break;
 #ifdef CONFIG_PRAMFS_XATTR
@@ -320,6 +390,37 @@ static int pram_parse_options(char *options, struct pram_sb_info *sbi,
 			pram_info("xip option not supported\n");
 			break;
 #endif
+		case Opt_xip_huge:
+#ifdef CONFIG_PRAMFS_XIP
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, XIP);
+			set_opt(sbi->s_mount_opt, XIP_HUGE);
+			break;
+#else
+			pram_info("xip_huge option not supported\n");
+			break;
+#endif
+		case Opt_extents:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, EXTENTS);
+			break;
+		case Opt_direct:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, DIRECT);
+			break;
+		case Opt_inline_data:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, INLINE_DATA);
+			break;
+		case Opt_64bit:
+			if (remount)
+				goto bad_opt;
+			set_opt(sbi->s_mount_opt, 64BIT);
+			break;
 		default: {
 			goto bad_opt;
 		}
@@ -353,6 +454,8 @@ static struct pram_inode *pram_init(struct super_block *sb, unsigned long size)
 		printk(KERN_ERR "ioremap of the pramfs image failed\n");
 		return ERR_PTR(-EINVAL);
 	}
+	if (pram_map_data_alias(sb, size))
+		return ERR_PTR(-EINVAL);
 
 #ifdef CONFIG_PRAMFS_TEST
 	if (!first_pram_super)
@@ -409,6 +512,12 @@ static struct pram_inode *pram_init(struct super_block *sb, unsigned long size)
 		return ERR_PTR(-EINVAL);
 	}
 
+	if ((u64)num_blocks >> 32 && !test_opt(sb, 64BIT)) {
+		printk(KERN_ERR "too many blocks, the 64bit option "
+		       "is needed\n");
+		return ERR_PTR(-EINVAL);
+	}
+
 	/* calc the data blocks in-use bitmap size in bytes */
 	if (num_blocks & 7)
 		bitmap_size = ((num_blocks + 8) & ~7) >> 3;
@@ -425,22 +534,35 @@ static struct pram_inode *pram_init(struct super_block *sb, unsigned long size)
 	pram_dbg("max name length %d\n", (unsigned int)PRAM_NAME_LEN);
 
 	super = pram_get_super(sb);
-	pram_memunlock_range(sb, super, bitmap_start + bitmap_size);
+	pram_memunlock_range_global(sb, super, bitmap_start + bitmap_size);
 
 	/* clear out super-block and inode table */
 	memset(super, 0, bitmap_start);
+	if (test_opt(sb, 64BIT))
+		super->s_feature_incompat |=
+			cpu_to_be32(PRAM_FEATURE_INCOMPAT_64BIT);
 	super->s_size = cpu_to_be64(size);
 	super->s_blocksize = cpu_to_be32(blocksize);
 	super->s_inodes_count = cpu_to_be32(num_inodes);
-	super->s_blocks_count = cpu_to_be32(num_blocks);
+	pram_set_blocks_count(super, num_blocks);
 	super->s_free_inodes_count = cpu_to_be32(num_inodes - 1);
 	super->s_bitmap_blocks = cpu_to_be32(bitmap_size >>
 							  sb->s_blocksize_bits);
-	super->s_free_blocks_count =
-		cpu_to_be32(num_blocks - be32_to_cpu(super->s_bitmap_blocks));
+	pram_set_free_blocks_count(super, num_blocks -
+				   be32_to_cpu(super->s_bitmap_blocks));
 	super->s_free_inode_hint = cpu_to_be32(1);
 	super->s_bitmap_start = cpu_to_be64(bitmap_start);
 	super->s_magic = cpu_to_be16(PRAM_SUPER_MAGIC);
+	super->s_state = cpu_to_be16(PRAM_VALID_FS);
+	if (test_opt(sb, EXTENTS))
+		super->s_feature_incompat |=
+			cpu_to_be32(PRAM_FEATURE_INCOMPAT_EXTENTS);
+	if (test_opt(sb, DIRECT))
+		super->s_feature_incompat |=
+			cpu_to_be32(PRAM_FEATURE_INCOMPAT_DIRECT);
+	if (test_opt(sb, INLINE_DATA))
+		super->s_feature_incompat |=
+			cpu_to_be32(PRAM_FEATURE_INCOMPAT_INLINE_DATA);
 	pram_sync_super(super);
 
 	root_i = pram_get_inode(sb, PRAM_ROOT_INO);
@@ -454,7 +576,7 @@ static struct pram_inode *pram_init(struct super_block *sb, unsigned long size)
 
 	pram_init_bitmap(sb);
 
-	pram_memlock_range(sb, super, bitmap_start + bitmap_size);
+	pram_memlock_range_global(sb, super, bitmap_start + bitmap_size);
 
 	return root_i;
 }
@@ -494,6 +616,138 @@ static void pram_root_check(struct super_block *sb, struct pram_inode *root_pi)
 	pram_memlock_inode(sb, root_pi);
 }
 
+/* pram_checkpoint()
+ *
+ * Write back to the super block the free counters and hints kept in DRAM.
+ * The fs is marked clean only when nothing can change them anymore, i.e.
+ * at unmount or remount read-only.
+ */
+void pram_checkpoint(struct super_block *sb, int clean)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	struct pram_super_block *ps = pram_get_super(sb);
+	unsigned long first;
+	u16 state;
+
+	first = pram_first_free_block(sb);
+
+	mutex_lock(&sbi->s_lock);
+	state = be16_to_cpu(ps->s_state);
+	if (clean)
+		state |= PRAM_VALID_FS;
+	else
+		state &= ~PRAM_VALID_FS;
+
+	pram_memunlock_super(sb, ps);
+	pram_set_free_blocks_count(ps,
+		percpu_counter_sum_positive(&sbi->s_freeblocks_counter));
+	ps->s_free_blocknr_hint = cpu_to_be32(first);
+	ps->s_free_inodes_count = cpu_to_be32(
+		percpu_counter_sum_positive(&sbi->s_freeinodes_counter));
+	ps->s_free_inode_hint = cpu_to_be32(pram_free_inode_hint(sb));
+	ps->s_state = cpu_to_be16(state);
+	pram_memlock_super(sb, ps);
+	mutex_unlock(&sbi->s_lock);
+}
+
+static void pram_checkpoint_work(struct work_struct *work)
+{
+	struct pram_sb_info *sbi = container_of(to_delayed_work(work),
+					struct pram_sb_info, s_checkpoint_work);
+	struct super_block *sb = sbi->s_sb;
+
+	if (!(sb->s_flags & MS_RDONLY))
+		pram_checkpoint(sb, 0);
+}
+
+static int pram_sync_fs(struct super_block *sb, int wait)
+{
+	if (!(sb->s_flags & MS_RDONLY))
+		pram_checkpoint(sb, 0);
+	return 0;
+}
+
+/*
+ * Set up the free counters. They are always counted while building the
+ * free blocks tree and the inode bitmap, the copies in the super block
+ * are only a checkpoint.
+ */
+static int pram_init_counters(struct super_block *sb,
+			      unsigned long free_blocks,
+			      unsigned long free_inodes)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	int err;
+
+	err = percpu_counter_init(&sbi->s_freeblocks_counter, free_blocks);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_freeinodes_counter,
+					  free_inodes);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_map_hits, 0);
+	if (!err)
+		err = percpu_counter_init(&sbi->s_map_misses, 0);
+	return err;
+}
+
+static void pram_destroy_counters(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	proc_remove(sbi->s_proc);
+	sbi->s_proc = NULL;
+	cancel_delayed_work_sync(&sbi->s_checkpoint_work);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	percpu_counter_destroy(&sbi->s_map_hits);
+	percpu_counter_destroy(&sbi->s_map_misses);
+}
+
+/*
+ * Statistics in /proc/fs/pramfs/<physaddr>, the physical address being
+ * the only unique name of a pramfs instance.
+ */
+static struct proc_dir_entry *pram_proc_root;
+
+static int pram_map_cache_show(struct seq_file *seq, void *v)
+{
+	struct pram_sb_info *sbi = PRAM_SB(seq->private);
+
+	seq_printf(seq, "hits %lld\nmisses %lld\n",
+		   percpu_counter_sum_positive(&sbi->s_map_hits),
+		   percpu_counter_sum_positive(&sbi->s_map_misses));
+	return 0;
+}
+
+static int pram_map_cache_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pram_map_cache_show, PDE_DATA(inode));
+}
+
+static const struct file_operations pram_map_cache_fops = {
+	.owner		= THIS_MODULE,
+	.open		= pram_map_cache_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* The statistics are optional, a failure here is not fatal */
+static void pram_proc_register(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	char name[24];
+
+	if (!pram_proc_root)
+		return;
+
+	snprintf(name, sizeof(name), "%llx", (u64)sbi->phys_addr);
+	sbi->s_proc = proc_mkdir(name, pram_proc_root);
+	if (sbi->s_proc)
+		proc_create_data("map_cache", S_IRUGO, sbi->s_proc,
+				 &pram_map_cache_fops, sb);
+}
+
 static int pram_fill_super(struct super_block *sb, void *data, int silent)
 {
 	struct pram_super_block *super, *super_redund;
@@ -502,7 +756,9 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 	struct inode *root_i = NULL;
 	unsigned long blocksize, initsize = 0;
 	u32 random = 0;
-	int retval = -EINVAL;
+	unsigned long free_blocks, free_inodes;
+	int clean, retval = -EINVAL;
+	u32 features;
 
 	BUILD_BUG_ON(sizeof(struct pram_super_block) > PRAM_SB_SIZE);
 	BUILD_BUG_ON(sizeof(struct pram_inode) > PRAM_INODE_SIZE);
@@ -515,6 +771,14 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 	set_default_opts(sbi);
 
 	mutex_init(&sbi->s_lock);
+	sbi->s_sb = sb;
+	INIT_DELAYED_WORK(&sbi->s_checkpoint_work, pram_checkpoint_work);
+	spin_lock_init(&sbi->s_prealloc_lock);
+	INIT_LIST_HEAD(&sbi->s_prealloc_list);
+	if (pram_wp_init(sb)) {
+		kfree(sbi);
+		return -ENOMEM;
+	}
 #ifdef CONFIG_PRAMFS_XATTR
 	spin_lock_init(&sbi->desc_tree_lock);
 	sbi->desc_tree.rb_node = NULL;
@@ -607,6 +871,46 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 		}
 	}
 
+	features = be32_to_cpu(super->s_feature_incompat);
+	if (features & ~PRAM_FEATURE_INCOMPAT_SUPP) {
+		printk(KERN_ERR "unsupported pramfs features 0x%x\n",
+		       features & ~PRAM_FEATURE_INCOMPAT_SUPP);
+		goto out;
+	}
+
+	/* the extents are chosen when the filesystem is created */
+	if (test_opt(sb, EXTENTS) &&
+	    !(features & PRAM_FEATURE_INCOMPAT_EXTENTS))
+		pram_info("extents option ignored, the filesystem "
+			  "has not been created with it\n");
+	clear_opt(sbi->s_mount_opt, EXTENTS);
+	if (features & PRAM_FEATURE_INCOMPAT_EXTENTS)
+		set_opt(sbi->s_mount_opt, EXTENTS);
+
+	if (test_opt(sb, DIRECT) &&
+	    !(features & PRAM_FEATURE_INCOMPAT_DIRECT))
+		pram_info("direct option ignored, the filesystem "
+			  "has not been created with it\n");
+	clear_opt(sbi->s_mount_opt, DIRECT);
+	if (features & PRAM_FEATURE_INCOMPAT_DIRECT)
+		set_opt(sbi->s_mount_opt, DIRECT);
+
+	if (test_opt(sb, INLINE_DATA) &&
+	    !(features & PRAM_FEATURE_INCOMPAT_INLINE_DATA))
+		pram_info("inline_data option ignored, the filesystem "
+			  "has not been created with it\n");
+	clear_opt(sbi->s_mount_opt, INLINE_DATA);
+	if (features & PRAM_FEATURE_INCOMPAT_INLINE_DATA)
+		set_opt(sbi->s_mount_opt, INLINE_DATA);
+
+	if (test_opt(sb, 64BIT) &&
+	    !(features & PRAM_FEATURE_INCOMPAT_64BIT))
+		pram_info("64bit option ignored, the filesystem "
+			  "has not been created with it\n");
+	clear_opt(sbi->s_mount_opt, 64BIT);
+	if (features & PRAM_FEATURE_INCOMPAT_64BIT)
+		set_opt(sbi->s_mount_opt, 64BIT);
+
 	blocksize = be32_to_cpu(super->s_blocksize);
 	pram_set_blocksize(sb, blocksize);
 
@@ -631,6 +935,8 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 		printk(KERN_ERR "ioremap of the pramfs image failed\n");
 		goto out;
 	}
+	if (pram_map_data_alias(sb, initsize))
+		goto out;
 	super = pram_get_super(sb);
 
 #ifdef CONFIG_PRAMFS_TEST
@@ -642,7 +948,9 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
  setup_sb:
 	sb->s_magic = be16_to_cpu(super->s_magic);
 	sb->s_op = &pram_sops;
-	sb->s_maxbytes = pram_max_size(sb->s_blocksize_bits);
+	sb->s_maxbytes = pram_max_size(sb->s_blocksize_bits,
+				       test_opt(sb, EXTENTS),
+				       test_opt(sb, 64BIT));
 	sb->s_max_links = PRAM_LINK_MAX;
 	sb->s_export_op = &pram_export_ops;
 	sb->s_xattr = pram_xattr_handlers;
@@ -652,6 +960,38 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 		 MS_POSIXACL : 0;
 #endif
 	sb->s_flags |= MS_NOSEC;
+
+	clean = be16_to_cpu(super->s_state) & PRAM_VALID_FS;
+	if (!clean) {
+		pram_warn("unclean shutdown, recomputing free space\n");
+		if (!(sb->s_flags & MS_RDONLY))
+			pram_rebuild_bitmap(sb);
+		else
+			sbi->s_rebuild_pending = 1;
+	}
+
+	retval = pram_init_alloc_groups(sb, &free_blocks);
+	if (retval)
+		goto out;
+
+	retval = pram_init_inode_alloc(sb, &free_inodes);
+	if (retval)
+		goto out;
+
+	retval = pram_init_counters(sb, free_blocks, free_inodes);
+	if (retval)
+		goto out;
+
+	retval = pram_init_blk_pools(sb);
+	if (retval)
+		goto out;
+
+	if (!(sb->s_flags & MS_RDONLY)) {
+		retval = pram_start_zerod(sb);
+		if (retval)
+			goto out;
+	}
+
 	root_i = pram_iget(sb, PRAM_ROOT_INO);
 	if (IS_ERR(root_i)) {
 		retval = PTR_ERR(root_i);
@@ -665,9 +1005,21 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 		goto out;
 	}
 
+	pram_proc_register(sb);
+
+	/* The counters in the super block are stale from now on */
+	if (!(sb->s_flags & MS_RDONLY))
+		pram_checkpoint(sb, 0);
+
 	retval = 0;
 	return retval;
  out:
+	pram_stop_zerod(sb);
+	pram_destroy_blk_pools(sb);
+	pram_destroy_counters(sb);
+	pram_destroy_inode_alloc(sb);
+	pram_destroy_alloc_groups(sb);
+	pram_unmap_data_alias(sb);
 	if (sbi->virt_addr) {
 		if (pram_is_protected(sb))
 			pram_writeable(sbi->virt_addr, initsize, 1);
@@ -675,6 +1027,7 @@ static int pram_fill_super(struct super_block *sb, void *data, int silent)
 		release_mem_region(sbi->phys_addr, initsize);
 	}
 
+	pram_wp_destroy(sb);
 	kfree(sbi);
 	return retval;
 }
@@ -686,10 +1039,11 @@ int pram_statfs(struct dentry *d, struct kstatfs *buf)
 
 	buf->f_type = PRAM_SUPER_MAGIC;
 	buf->f_bsize = sb->s_blocksize;
-	buf->f_blocks = be32_to_cpu(ps->s_blocks_count);
+	buf->f_blocks = pram_blocks_count(ps);
 	buf->f_bfree = buf->f_bavail = pram_count_free_blocks(sb);
-	buf->f_files = be32_to_cpu(ps->s_inodes_count);
-	buf->f_ffree = be32_to_cpu(ps->s_free_inodes_count);
+	buf->f_files = PRAM_SB(sb)->s_inodes_count;
+	buf->f_ffree = percpu_counter_sum_positive(
+				&PRAM_SB(sb)->s_freeinodes_counter);
 	buf->f_namelen = PRAM_NAME_LEN;
 	return 0;
 }
@@ -723,6 +1077,8 @@ static int pram_show_options(struct seq_file *seq, struct dentry *root)
 	/* memory protection enabled by default */
 	if (!test_opt(root->d_sb, PROTECT))
 		seq_puts(seq, ",noprotect");
+	else if (test_opt(root->d_sb, PROTECT_METADATA))
+		seq_puts(seq, ",protect=metadata");
 #else
 	/*
 	 * If it's not compiled say to the user that there
@@ -745,7 +1101,9 @@ static int pram_show_options(struct seq_file *seq, struct dentry *root)
 
 #ifdef CONFIG_PRAMFS_XIP
 	/* xip not enabled by default */
-	if (test_opt(root->d_sb, XIP))
+	if (test_opt(root->d_sb, XIP_HUGE))
+		seq_puts(seq, ",xip_huge");
+	else if (test_opt(root->d_sb, XIP))
 		seq_puts(seq, ",xip");
 #endif
 
@@ -758,6 +1116,7 @@ int pram_remount(struct super_block *sb, int *mntflags, char *data)
 	unsigned long old_mount_opt;
 	struct pram_super_block *ps;
 	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long free_blocks;
 	int ret = -EINVAL;
 
 	/* Store the old options */
@@ -771,6 +1130,28 @@ int pram_remount(struct super_block *sb, int *mntflags, char *data)
 		((sbi->s_mount_opt & PRAM_MOUNT_POSIX_ACL) ? MS_POSIXACL : 0);
 
 	if ((*mntflags & MS_RDONLY) != (sb->s_flags & MS_RDONLY)) {
+		if (*mntflags & MS_RDONLY) {
+			/* Don't leave claimed blocks around on a read-only fs */
+			pram_stop_zerod(sb);
+			pram_discard_all_prealloc(sb);
+			pram_drain_blk_pools(sb);
+			cancel_delayed_work_sync(&sbi->s_checkpoint_work);
+			pram_checkpoint(sb, 1);
+		} else {
+			if (sbi->s_rebuild_pending) {
+				pram_warn("unclean shutdown, recomputing "
+					  "free space\n");
+				pram_rebuild_bitmap(sb);
+				pram_reset_alloc_groups(sb, &free_blocks);
+				percpu_counter_set(&sbi->s_freeblocks_counter,
+						   free_blocks);
+				sbi->s_rebuild_pending = 0;
+			}
+			ret = pram_start_zerod(sb);
+			if (ret)
+				goto restore_opt;
+			pram_checkpoint(sb, 0);
+		}
 		mutex_lock(&PRAM_SB(sb)->s_lock);
 		ps = pram_get_super(sb);
 		pram_memunlock_super(sb, ps);
@@ -801,7 +1182,16 @@ static void pram_put_super(struct super_block *sb)
 #endif
 
 	pram_xattr_put_super(sb);
+	pram_stop_zerod(sb);
+	pram_destroy_blk_pools(sb);
+	cancel_delayed_work_sync(&sbi->s_checkpoint_work);
+	if (!(sb->s_flags & MS_RDONLY))
+		pram_checkpoint(sb, 1);
+	pram_destroy_counters(sb);
+	pram_destroy_inode_alloc(sb);
+	pram_destroy_alloc_groups(sb);
 	/* It's unmount time, so unmap the pramfs memory */
+	pram_unmap_data_alias(sb);
 	if (sbi->virt_addr) {
 		if (pram_is_protected(sb))
 			pram_writeable(sbi->virt_addr, size, 1);
@@ -810,6 +1200,7 @@ static void pram_put_super(struct super_block *sb)
 		release_mem_region(sbi->phys_addr, size);
 	}
 
+	pram_wp_destroy(sb);
 	sb->s_fs_info = NULL;
 	kfree(sbi);
 }
@@ -821,6 +1212,7 @@ static struct inode *pram_alloc_inode(struct super_block *sb)
 	if (!vi)
 		return NULL;
 	vi->vfs_inode.i_version = 1;
+	pram_map_cache_invalidate(&vi->vfs_inode);
 	return &vi->vfs_inode;
 }
 
@@ -844,6 +1236,15 @@ static void init_once(void *foo)
 #endif
 	mutex_init(&vi->i_meta_mutex);
 	mutex_init(&vi->i_link_mutex);
+	spin_lock_init(&vi->i_prealloc_lock);
+	vi->i_prealloc_len = 0;
+	INIT_LIST_HEAD(&vi->i_prealloc_list);
+	mutex_init(&vi->i_ext_mutex);
+	seqcount_init(&vi->i_ext_seq);
+	spin_lock_init(&vi->i_map_lock);
+	seqcount_init(&vi->i_map_seq);
+	vi->i_map_gen = 0;
+	vi->i_map_next = 0;
 	inode_init_once(&vi->vfs_inode);
 }
 
@@ -881,6 +1282,7 @@ static struct super_operations pram_sops = {
 	.dirty_inode	= pram_dirty_inode,
 	.evict_inode	= pram_evict_inode,
 	.put_super	= pram_put_super,
+	.sync_fs	= pram_sync_fs,
 	.freeze_fs 	= pram_freeze_fs,
 	.unfreeze_fs 	= pram_unfreeze_fs,
 	.statfs		= pram_statfs,
@@ -905,13 +1307,9 @@ MODULE_ALIAS_FS("pramfs");
 static struct inode *pram_nfs_get_inode(struct super_block *sb,
 		u64 ino, u32 generation)
 {
-	struct pram_super_block *ps = pram_get_super(sb);
 	struct inode *inode;
 
-	if (ino < PRAM_ROOT_INO)
-		return ERR_PTR(-ESTALE);
-	if (((ino - PRAM_ROOT_INO) >> PRAM_INODE_BITS) >
-	  be32_to_cpu(ps->s_inodes_count))
+	if (pram_ino_to_nr(sb, ino) < 0)
 		return ERR_PTR(-ESTALE);
 
 	inode = pram_iget(sb, ino);
@@ -959,18 +1357,34 @@ static int __init init_pram_fs(void)
 	if (rc)
 		goto out1;
 
-	rc = bdi_init(&pram_backing_dev_info);
+	rc = init_pram_free_tree();
 	if (rc)
 		goto out2;
 
-	rc = register_filesystem(&pram_fs_type);
+	rc = init_pram_wprotect();
 	if (rc)
 		goto out3;
 
+	rc = bdi_init(&pram_backing_dev_info);
+	if (rc)
+		goto out4;
+
+	pram_proc_root = proc_mkdir("fs/pramfs", NULL);
+
+	rc = register_filesystem(&pram_fs_type);
+	if (rc)
+		goto out5;
+
 	return 0;
 
-out3:
+out5:
+	if (pram_proc_root)
+		remove_proc_entry("fs/pramfs", NULL);
 	bdi_destroy(&pram_backing_dev_info);
+out4:
+	exit_pram_wprotect();
+out3:
+	exit_pram_free_tree();
 out2:
 	destroy_inodecache();
 out1:
@@ -981,7 +1395,11 @@ out1:
 static void __exit exit_pram_fs(void)
 {
 	unregister_filesystem(&pram_fs_type);
+	if (pram_proc_root)
+		remove_proc_entry("fs/pramfs", NULL);
 	bdi_destroy(&pram_backing_dev_info);
+	exit_pram_wprotect();
+	exit_pram_free_tree();
 	destroy_inodecache();
 	exit_pram_xattr();
 }
@@ -20,10 +20,20 @@
 int pram_block_symlink(struct inode *inode, const char *symname, int len)
 {
 	struct super_block *sb = inode->i_sb;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
 	u64 block;
 	char *blockp;
 	int err;
 
+	/* a short target is stored in the inode, a fast symlink */
+	if (pram_has_inline_data(pi) && len < PRAM_INLINE_DATA_SIZE) {
+		pram_memunlock_inode(sb, pi);
+		memcpy(pi->i_type.data, symname, len);
+		pi->i_type.data[len] = '\0';
+		pram_memlock_inode(sb, pi);
+		return 0;
+	}
+
 	err = pram_alloc_blocks(inode, 0, 1);
 	if (err)
 		return err;
@@ -38,28 +48,26 @@ int pram_block_symlink(struct inode *inode, const char *symname, int len)
 	return 0;
 }
 
-static int pram_readlink(struct dentry *dentry, char __user *buffer, int buflen)
+/* The target of a symlink, it never moves once written */
+static char *pram_get_link(struct inode *inode)
 {
-	struct inode *inode = dentry->d_inode;
 	struct super_block *sb = inode->i_sb;
-	u64 block;
-	char *blockp;
+	struct pram_inode *pi = pram_get_inode(sb, inode->i_ino);
 
-	block = pram_find_data_block(inode, 0);
-	blockp = pram_get_block(sb, block);
-	return vfs_readlink(dentry, buffer, buflen, blockp);
+	if (pram_has_inline_data(pi))
+		return (char *)pi->i_type.data;
+	return pram_get_block(sb, pram_find_data_block(inode, 0));
 }
 
-static void *pram_follow_link(struct dentry *dentry, struct nameidata *nd)
+static int pram_readlink(struct dentry *dentry, char __user *buffer, int buflen)
 {
-	struct inode *inode = dentry->d_inode;
-	struct super_block *sb = inode->i_sb;
-	off_t block;
-	char *blockp;
+	return vfs_readlink(dentry, buffer, buflen,
+			    pram_get_link(dentry->d_inode));
+}
 
-	block = pram_find_data_block(inode, 0);
-	blockp = pram_get_block(sb, block);
-	nd_set_link(nd, blockp);
+static void *pram_follow_link(struct dentry *dentry, struct nameidata *nd)
+{
+	nd_set_link(nd, pram_get_link(dentry->d_inode));
 	return NULL;
 }
 
@@ -0,0 +1,87 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Block allocator scalability benchmark. Every thread grows its own file
+ * one block at a time, so every write allocates a new data block, then
+ * truncates it to free them again. The test is repeated doubling the
+ * number of threads and the allocation throughput is reported.
+ *
+ * Usage: allocbench [dir] [max threads] [blocks per thread] [rounds]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/statvfs.h>
+
+#include "bench.h"
+
+static const char *dir = "/pram";
+static long nr_blocks = 4096;
+static int rounds = 4;
+static long bsize;
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	char path[256];
+	char *buf;
+	ssize_t n;
+	long i;
+	int r, fd, ret;
+
+	snprintf(path, sizeof(path), "%s/allocbench.%ld", dir, id);
+	buf = malloc(bsize);
+	assert(buf != NULL);
+	memset(buf, 0x5a, bsize);
+
+	fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0644);
+	assert(fd != -1);
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nr_blocks; i++) {
+			n = pwrite(fd, buf, bsize, i * bsize);
+			assert(n == bsize);
+		}
+		ret = ftruncate(fd, 0);
+		assert(ret == 0);
+	}
+
+	close(fd);
+	unlink(path);
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	struct statvfs st;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int ret;
+
+	if (argc > 1)
+		dir = argv[1];
+	if (argc > 2)
+		max_threads = atol(argv[2]);
+	if (argc > 3)
+		nr_blocks = atol(argv[3]);
+	if (argc > 4)
+		rounds = atoi(argv[4]);
+
+	ret = statvfs(dir, &st);
+	assert(ret == 0);
+	bsize = st.f_bsize;
+
+	printf("block size %ld, %ld blocks per thread, %d rounds\n",
+	       bsize, nr_blocks, rounds);
+	scale_threads(worker, max_threads, (double)nr_blocks * rounds,
+		      "blocks/s");
+	return 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Timing and thread scaling helpers shared by the benchmarks.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PRAM_BENCH_H
+#define _PRAM_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+/* seconds from start to end */
+static inline double elapsed(struct timeval *start, struct timeval *end)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_usec - start->tv_usec) / 1000000.0;
+}
+
+/*
+ * Run worker in threads threads at once, each one getting its index as
+ * argument, and return the seconds taken by all of them.
+ */
+static inline double run_threads(void *(*worker)(void *), long threads)
+{
+	pthread_t *tid;
+	struct timeval start, end;
+	long i;
+	int ret;
+
+	tid = malloc(threads * sizeof(pthread_t));
+	assert(tid != NULL);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < threads; i++) {
+		ret = pthread_create(&tid[i], NULL, worker, (void *)i);
+		assert(ret == 0);
+	}
+	for (i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+	gettimeofday(&end, NULL);
+
+	free(tid);
+	return elapsed(&start, &end);
+}
+
+/*
+ * Run worker doubling the number of threads up to max_threads, and print
+ * the rate of each run, every thread doing ops operations named unit, and
+ * its scaling from the single thread run.
+ */
+static inline void scale_threads(void *(*worker)(void *), long max_threads,
+				 double ops, const char *unit)
+{
+	double secs, rate, base = 0;
+	long threads;
+
+	printf("%8s %12s %14s %8s\n", "threads", "seconds", unit, "scale");
+
+	for (threads = 1; threads <= max_threads; threads <<= 1) {
+		secs = run_threads(worker, threads);
+		rate = threads * ops / secs;
+		if (!base)
+			base = rate;
+		printf("%8ld %12.3f %14.0f %8.2f\n", threads, secs, rate,
+		       rate / base);
+	}
+}
+
+#endif /* _PRAM_BENCH_H */
@@ -0,0 +1,130 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Write a sparse file beyond 4GB and read it back after a remount. Run
+ * "bigfile write" on a filesystem created with the "64bit" option and
+ * mounted on ./pram, remount it without "init=", then run "bigfile check".
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#define BLK	4096
+#define GB	(1ULL << 30)
+
+/* the blocks written around the 32 bits limits, the last one ends the file */
+static const uint64_t offsets[] = {
+	0,
+	2 * GB - BLK,
+	2 * GB,
+	4 * GB - BLK,
+	4 * GB,
+	4 * GB + 3 * BLK,
+	6 * GB + 5 * BLK,
+};
+
+#define NOFFS	(sizeof(offsets) / sizeof(offsets[0]))
+#define SIZE	(offsets[NOFFS - 1] + BLK)
+
+/* each block holds its own offset */
+static void fill(uint64_t *buf, uint64_t off)
+{
+	unsigned int i;
+
+	for (i = 0; i < BLK / sizeof(*buf); i++)
+		buf[i] = off + i;
+}
+
+static void do_write(void)
+{
+	uint64_t buf[BLK / sizeof(uint64_t)];
+	unsigned int i;
+	ssize_t n;
+	int fd;
+
+	fd = open("./pram/bigfile", O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	for (i = 0; i < NOFFS; i++) {
+		fill(buf, offsets[i]);
+		n = pwrite(fd, buf, BLK, offsets[i]);
+		if (n != BLK) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	close(fd);
+}
+
+static void do_check(void)
+{
+	uint64_t buf[BLK / sizeof(uint64_t)], ref[BLK / sizeof(uint64_t)];
+	struct stat st;
+	unsigned int i;
+	ssize_t n;
+	int fd;
+
+	fd = open("./pram/bigfile", O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	printf("size %llu, %llu blocks\n", (unsigned long long)st.st_size,
+	       (unsigned long long)st.st_blocks);
+	assert((uint64_t)st.st_size == SIZE);
+
+	for (i = 0; i < NOFFS; i++) {
+		n = pread(fd, buf, BLK, offsets[i]);
+		if (n != BLK) {
+			perror("pread");
+			exit(1);
+		}
+		fill(ref, offsets[i]);
+		assert(!memcmp(buf, ref, BLK));
+	}
+
+	/* a hole between two blocks written, above 4GB */
+	n = pread(fd, buf, BLK, 4 * GB + BLK);
+	if (n != BLK) {
+		perror("pread");
+		exit(1);
+	}
+	memset(ref, 0, BLK);
+	assert(!memcmp(buf, ref, BLK));
+
+	n = pread(fd, buf, BLK, SIZE);
+	assert(n == 0);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc == 2 && !strcmp(argv[1], "write"))
+		do_write();
+	else if (argc == 2 && !strcmp(argv[1], "check"))
+		do_check();
+	else {
+		fprintf(stderr, "Usage: bigfile write|check\n");
+		exit(1);
+	}
+	return 0;
+}
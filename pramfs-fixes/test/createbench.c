@@ -0,0 +1,78 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Inode allocation scalability benchmark. Every thread creates and then
+ * unlinks a batch of empty files in its own directory, so that the
+ * threads contend only on the inode allocator and not on a directory
+ * lock. The test is repeated doubling the number of threads and the
+ * creates per second are reported.
+ *
+ * Usage: createbench [dir] [max threads] [files per thread] [rounds]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bench.h"
+
+static const char *dir = "/pram";
+static long nr_files = 1000;
+static int rounds = 4;
+
+static void *worker(void *arg)
+{
+	long id = (long)arg;
+	char path[256], name[300];
+	long i;
+	int r, fd, ret;
+
+	snprintf(path, sizeof(path), "%s/createbench.%ld", dir, id);
+	ret = mkdir(path, 0755);
+	assert(ret == 0);
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < nr_files; i++) {
+			snprintf(name, sizeof(name), "%s/%ld", path, i);
+			fd = open(name, O_CREAT|O_EXCL|O_WRONLY, 0644);
+			assert(fd != -1);
+			close(fd);
+		}
+		for (i = 0; i < nr_files; i++) {
+			snprintf(name, sizeof(name), "%s/%ld", path, i);
+			ret = unlink(name);
+			assert(ret == 0);
+		}
+	}
+
+	ret = rmdir(path);
+	assert(ret == 0);
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (argc > 1)
+		dir = argv[1];
+	if (argc > 2)
+		max_threads = atol(argv[2]);
+	if (argc > 3)
+		nr_files = atol(argv[3]);
+	if (argc > 4)
+		rounds = atoi(argv[4]);
+
+	printf("%ld files per thread, %d rounds\n", nr_files, rounds);
+	scale_threads(worker, max_threads, (double)nr_files * rounds,
+		      "creates/s");
+	return 0;
+}
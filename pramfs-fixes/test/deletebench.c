@@ -0,0 +1,96 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * File deletion benchmark. It fills a few files of the given size, then
+ * times the unlink of each one, so the measure is dominated by the release
+ * of the data blocks. The deletion throughput is reported in MB/s and in
+ * blocks/s.
+ *
+ * Usage: deletebench [dir] [file size in MB] [files]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
+
+#include "bench.h"
+
+#define CHUNK	(1024 * 1024)
+
+static const char *dir = "/pram";
+static long size_mb = 256;
+static int files = 4;
+
+static void fill(const char *path, char *buf)
+{
+	ssize_t n;
+	long i;
+	int fd, ret;
+
+	fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0644);
+	assert(fd != -1);
+	for (i = 0; i < size_mb; i++) {
+		n = write(fd, buf, CHUNK);
+		assert(n == CHUNK);
+	}
+	ret = fsync(fd);
+	assert(ret == 0);
+	close(fd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct statvfs st;
+	struct timeval start, end;
+	char path[256];
+	char *buf;
+	double secs, total = 0;
+	int i, ret;
+
+	if (argc > 1)
+		dir = argv[1];
+	if (argc > 2)
+		size_mb = atol(argv[2]);
+	if (argc > 3)
+		files = atoi(argv[3]);
+
+	ret = statvfs(dir, &st);
+	assert(ret == 0);
+	buf = malloc(CHUNK);
+	assert(buf != NULL);
+	memset(buf, 0x5a, CHUNK);
+
+	printf("block size %ld, %d files of %ld MB\n", (long)st.f_bsize,
+	       files, size_mb);
+	printf("%8s %12s %12s %14s\n", "file", "seconds", "MB/s", "blocks/s");
+
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/deletebench.%d", dir, i);
+		fill(path, buf);
+
+		gettimeofday(&start, NULL);
+		ret = unlink(path);
+		assert(ret == 0);
+		gettimeofday(&end, NULL);
+
+		secs = elapsed(&start, &end);
+		total += secs;
+		printf("%8d %12.6f %12.1f %14.0f\n", i, secs, size_mb / secs,
+		       (double)size_mb * CHUNK / st.f_bsize / secs);
+	}
+
+	printf("%8s %12.6f %12.1f %14.0f\n", "avg", total / files,
+	       size_mb * files / total,
+	       (double)size_mb * files * CHUNK / st.f_bsize / total);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Move a file stored inline to a block, by a write beyond the inode and by
+ * a fallocate, and read it back. Run it on a filesystem created with the
+ * "inline_data" option, mounted on ./pram without xip.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/falloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#define INLINE	"inline data"	/* shorter than 16 bytes */
+#define BLK	4096
+
+static int create(const char *path)
+{
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	n = write(fd, INLINE, sizeof(INLINE));
+	if (n != sizeof(INLINE)) {
+		perror("write");
+		exit(1);
+	}
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	/* no data block yet */
+	assert(st.st_blocks == 0);
+	return fd;
+}
+
+/* the inline data, then zeroes up to size */
+static void check(int fd, off_t size)
+{
+	struct stat st;
+	char *buf;
+	ssize_t n;
+	off_t i;
+
+	buf = malloc(size + 1);
+	n = pread(fd, buf, size + 1, 0);
+	if (n < 0) {
+		perror("pread");
+		exit(1);
+	}
+	assert(n == size);
+	assert(!memcmp(buf, INLINE, sizeof(INLINE)));
+	for (i = sizeof(INLINE); i < size; i++)
+		assert(!buf[i]);
+	free(buf);
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	assert(st.st_size == size);
+	assert(st.st_blocks > 0);
+}
+
+int main(int argc, char *argv[])
+{
+	ssize_t n;
+	char c;
+	int fd;
+
+	/* a write beyond the inode moves the data to a block */
+	fd = create("./pram/inline_write");
+	c = 'x';
+	n = pwrite(fd, &c, 1, BLK + 10);
+	if (n != 1) {
+		perror("pwrite");
+		exit(1);
+	}
+	n = pread(fd, &c, 1, BLK + 10);
+	assert(n == 1 && c == 'x');
+	check(fd, BLK + 10);
+	close(fd);
+
+	/* so does a fallocate, keeping the size or not */
+	fd = create("./pram/inline_falloc");
+	if (syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, 0, BLK)) {
+		perror("fallocate");
+		exit(1);
+	}
+	check(fd, sizeof(INLINE));
+	if (syscall(__NR_fallocate, fd, 0, 0, 2 * BLK)) {
+		perror("fallocate");
+		exit(1);
+	}
+	check(fd, 2 * BLK);
+	close(fd);
+
+	unlink("./pram/inline_write");
+	unlink("./pram/inline_falloc");
+	return 0;
+}
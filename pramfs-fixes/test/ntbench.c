@@ -0,0 +1,164 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Non-temporal store microbenchmark. It fills a buffer much bigger than
+ * the CPU caches chunk by chunk, zeroing and copying every chunk with the
+ * plain routines (memset, memcpy and rep stos) and with the streaming
+ * stores used by pramfs (movnti). The throughput of every routine is
+ * reported for a range of chunk sizes, to choose PRAM_NT_THRESHOLD.
+ *
+ * If a file is given, the buffer is mapped from it: on a pramfs mounted
+ * with the xip option the stores hit the protected RAM directly.
+ *
+ * Usage: ntbench [buffer size in MB] [file]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "bench.h"
+
+#if !defined(__x86_64__)
+#error "ntbench needs x86-64"
+#endif
+
+static long size_mb = 256;
+static char *dst, *src;
+static size_t size;
+
+static void zero_memset(void *d, size_t len)
+{
+	memset(d, 0, len);
+}
+
+static void zero_stos(void *d, size_t len)
+{
+	asm volatile("rep stosb" : "+D" (d), "+c" (len) : "a" (0) : "memory");
+}
+
+static void zero_nt(void *d, size_t len)
+{
+	unsigned long *p = d;
+	size_t n = len >> 3;
+
+	for (; n >= 4; n -= 4, p += 4)
+		asm volatile("movnti %1, (%0)\n\t"
+			     "movnti %1, 8(%0)\n\t"
+			     "movnti %1, 16(%0)\n\t"
+			     "movnti %1, 24(%0)\n\t"
+			     : : "r" (p), "r" (0UL) : "memory");
+	for (; n; n--, p++)
+		asm volatile("movnti %1, (%0)" : : "r" (p), "r" (0UL)
+			     : "memory");
+	asm volatile("sfence" : : : "memory");
+}
+
+static void copy_memcpy(void *d, const void *s, size_t len)
+{
+	memcpy(d, s, len);
+}
+
+static void copy_nt(void *d, const void *s, size_t len)
+{
+	unsigned long *p = d;
+	const unsigned long *q = s;
+	unsigned long a, b, c, e;
+	size_t n = len >> 3;
+
+	for (; n >= 4; n -= 4, p += 4, q += 4) {
+		a = q[0];
+		b = q[1];
+		c = q[2];
+		e = q[3];
+		asm volatile("movnti %1, (%0)\n\t"
+			     "movnti %2, 8(%0)\n\t"
+			     "movnti %3, 16(%0)\n\t"
+			     "movnti %4, 24(%0)\n\t"
+			     : : "r" (p), "r" (a), "r" (b), "r" (c), "r" (e)
+			     : "memory");
+	}
+	for (; n; n--, p++, q++)
+		asm volatile("movnti %1, (%0)" : : "r" (p), "r" (*q)
+			     : "memory");
+	asm volatile("sfence" : : : "memory");
+}
+
+static double bench_zero(void (*fn)(void *, size_t), size_t chunk)
+{
+	struct timeval start, end;
+	size_t off;
+
+	gettimeofday(&start, NULL);
+	for (off = 0; off + chunk <= size; off += chunk)
+		fn(dst + off, chunk);
+	gettimeofday(&end, NULL);
+	return size / elapsed(&start, &end) / (1024 * 1024);
+}
+
+static double bench_copy(void (*fn)(void *, const void *, size_t),
+			 size_t chunk)
+{
+	struct timeval start, end;
+	size_t off;
+
+	gettimeofday(&start, NULL);
+	for (off = 0; off + chunk <= size; off += chunk)
+		fn(dst + off, src + off, chunk);
+	gettimeofday(&end, NULL);
+	return size / elapsed(&start, &end) / (1024 * 1024);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t chunk;
+	int fd, ret;
+
+	if (argc > 1)
+		size_mb = atol(argv[1]);
+	size = size_mb * 1024 * 1024;
+
+	if (argc > 2) {
+		fd = open(argv[2], O_CREAT|O_RDWR, 0644);
+		assert(fd != -1);
+		ret = ftruncate(fd, size);
+		assert(ret == 0);
+		dst = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+	} else {
+		dst = mmap(NULL, size, PROT_READ|PROT_WRITE,
+			   MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	}
+	assert(dst != MAP_FAILED);
+	src = malloc(size);
+	assert(src != NULL);
+
+	/* fault everything in before timing */
+	memset(src, 0x5a, size);
+	memset(dst, 0xa5, size);
+
+	printf("buffer %ld MB, throughput in MB/s\n", size_mb);
+	printf("%8s %10s %10s %10s %10s %10s\n", "chunk", "memset", "stos",
+	       "movnti", "memcpy", "nt copy");
+
+	for (chunk = 64; chunk <= 1024 * 1024; chunk <<= 1)
+		printf("%8zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", chunk,
+		       bench_zero(zero_memset, chunk),
+		       bench_zero(zero_stos, chunk),
+		       bench_zero(zero_nt, chunk),
+		       bench_copy(copy_memcpy, chunk),
+		       bench_copy(copy_nt, chunk));
+
+	munmap(dst, size);
+	free(src);
+	return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Write protection cost benchmark. A file is overwritten in place, so
+ * that no block is allocated during the measure, with writes of growing
+ * size, once on a filesystem mounted with the memory protection and once
+ * on one mounted with "noprotect". The cost of writing a MB is reported
+ * for both and their difference is the cost of the protection windows.
+ * A "protect=metadata" mount can be given in place of the "noprotect" one,
+ * its file data writes should cost about the same.
+ *
+ * Usage: protbench [protected dir] [noprotect dir] [file MB] [rounds]
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/statvfs.h>
+
+#include "bench.h"
+
+#define MB (1024 * 1024)
+
+static const char *prot_dir = "/pram";
+static const char *noprot_dir = "/pram-noprotect";
+static long file_mb = 16;
+static int rounds = 4;
+
+/* Microseconds to write a MB to a file in dir with writes of len bytes */
+static double run(const char *dir, long len)
+{
+	struct timeval start, end;
+	char path[256];
+	char *buf;
+	long off, size = file_mb * MB;
+	ssize_t n;
+	int r, fd;
+
+	snprintf(path, sizeof(path), "%s/protbench", dir);
+	buf = malloc(MB);
+	assert(buf != NULL);
+	memset(buf, 0x5a, MB);
+
+	fd = open(path, O_CREAT|O_TRUNC|O_RDWR, 0644);
+	assert(fd != -1);
+
+	/* allocate all the blocks first */
+	for (off = 0; off < size; off += MB) {
+		n = pwrite(fd, buf, MB, off);
+		assert(n == MB);
+	}
+
+	gettimeofday(&start, NULL);
+	for (r = 0; r < rounds; r++)
+		for (off = 0; off < size; off += len) {
+			n = pwrite(fd, buf, len, off);
+			assert(n == len);
+		}
+	gettimeofday(&end, NULL);
+
+	close(fd);
+	unlink(path);
+	free(buf);
+	return elapsed(&start, &end) * 1000000.0 / (file_mb * rounds);
+}
+
+int main(int argc, char *argv[])
+{
+	struct statvfs st;
+	long len, bsize;
+	int ret;
+
+	if (argc > 1)
+		prot_dir = argv[1];
+	if (argc > 2)
+		noprot_dir = argv[2];
+	if (argc > 3)
+		file_mb = atol(argv[3]);
+	if (argc > 4)
+		rounds = atoi(argv[4]);
+
+	ret = statvfs(prot_dir, &st);
+	assert(ret == 0);
+	bsize = st.f_bsize;
+
+	printf("block size %ld, %ld MB file, %d rounds\n", bsize, file_mb,
+	       rounds);
+	printf("%10s %14s %14s %14s\n", "write size", "protect us/MB",
+	       "noprotect us/MB", "overhead us/MB");
+
+	for (len = bsize; len <= MB; len <<= 2) {
+		double prot, noprot;
+
+		prot = run(prot_dir, len);
+		noprot = run(noprot_dir, len);
+		printf("%10ld %14.1f %14.1f %14.1f\n", len, prot, noprot,
+		       prot - noprot);
+	}
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * PRAMFS: persistent and protected RAM Filesystem
+ *
+ * Truncate a file mapped by many extents in the middle of them and read it
+ * back. Run it on a filesystem created with the "extents" option, mounted
+ * on ./pram.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/falloc.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <fcntl.h>
+#include <assert.h>
+
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02
+#endif
+
+#define BLK	4096
+#define NBLK	93	/* the file ends with an extent */
+
+/* blocks 0-2, 6-8, 12-14... are written, the others are holes */
+static int written(int blk)
+{
+	return !((blk / 3) & 1);
+}
+
+static void fill(char *buf, int blk)
+{
+	memset(buf, 'a' + blk % 26, BLK);
+}
+
+/* read the file back up to size, and check nothing is beyond it */
+static void check(int fd, off_t size)
+{
+	char buf[BLK], ref[BLK];
+	ssize_t n;
+	off_t off;
+	int blk;
+
+	for (off = 0; off < size; off += n) {
+		blk = off / BLK;
+		n = pread(fd, buf, BLK, off);
+		if (n < 0) {
+			perror("pread");
+			exit(1);
+		}
+		assert(n == (size - off < BLK ? size - off : BLK));
+		if (written(blk))
+			fill(ref, blk);
+		else
+			memset(ref, 0, BLK);
+		assert(!memcmp(buf, ref, n));
+	}
+	n = pread(fd, buf, BLK, size);
+	assert(n == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	static const off_t cuts[] = {
+		80 * BLK + 100,	/* inside an extent */
+		72 * BLK,	/* at the start of an extent */
+		63 * BLK,	/* at the end of an extent */
+		40 * BLK + 1,	/* inside a hole */
+		1,
+	};
+	char buf[BLK];
+	struct stat st;
+	blkcnt_t blocks;
+	ssize_t n;
+	unsigned int i;
+	int fd, blk;
+
+	fd = open("./pram/truncextents", O_RDWR|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1) {
+		perror("open");
+		exit(1);
+	}
+
+	for (blk = 0; blk < NBLK; blk++) {
+		if (!written(blk))
+			continue;
+		fill(buf, blk);
+		n = pwrite(fd, buf, BLK, (off_t)blk * BLK);
+		if (n != BLK) {
+			perror("pwrite");
+			exit(1);
+		}
+	}
+	check(fd, NBLK * BLK);
+
+	if (fstat(fd, &st)) {
+		perror("fstat");
+		exit(1);
+	}
+	blocks = st.st_blocks;
+
+	/* the holes must stay holes, there is no punch */
+	if (!syscall(__NR_fallocate, fd,
+		     FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, BLK)) {
+		fprintf(stderr, "punch hole unexpectedly supported\n");
+		exit(1);
+	}
+	assert(errno == EOPNOTSUPP);
+
+	for (i = 0; i < sizeof(cuts) / sizeof(cuts[0]); i++) {
+		if (ftruncate(fd, cuts[i])) {
+			perror("ftruncate");
+			exit(1);
+		}
+		check(fd, cuts[i]);
+
+		if (fstat(fd, &st)) {
+			perror("fstat");
+			exit(1);
+		}
+		printf("size %ld: %ld blocks\n", (long)cuts[i],
+		       (long)st.st_blocks);
+		assert(st.st_blocks < blocks);
+		blocks = st.st_blocks;
+	}
+
+	/* growing it back must not bring the old data back */
+	if (ftruncate(fd, NBLK * BLK)) {
+		perror("ftruncate");
+		exit(1);
+	}
+	for (blk = 0; blk < NBLK; blk++) {
+		n = pread(fd, buf, BLK, (off_t)blk * BLK);
+		if (n != BLK) {
+			perror("pread");
+			exit(1);
+		}
+		if (!blk)
+			assert(buf[0] == 'a');
+		for (i = blk ? 0 : 1; i < BLK; i++)
+			assert(!buf[i]);
+	}
+
+	close(fd);
+	unlink("./pram/truncextents");
+	return 0;
+}
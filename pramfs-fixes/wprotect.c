@@ -16,20 +16,23 @@
 #include <linux/fs.h>
 #include <linux/mm.h>
 #include <linux/io.h>
+#include <linux/percpu.h>
+#include <linux/vmalloc.h>
+#ifdef CONFIG_X86
+#include <asm/tlbflush.h>
+#endif
 #include "pram.h"
 
 void pram_writeable(void *vaddr, unsigned long size, int rw)
 {
 	int ret = 0;
-	unsigned long nrpages = size >> PAGE_SHIFT;
 	unsigned long addr = (unsigned long)vaddr;
+	unsigned long nrpages;
 
-	/* Page aligned */
+	/* Page aligned, the range can start in the middle of a page */
+	nrpages = (PAGE_ALIGN(addr + size) - (addr & PAGE_MASK)) >> PAGE_SHIFT;
 	addr &= PAGE_MASK;
 
-	if (size & (PAGE_SIZE - 1))
-		nrpages++;
-
 	if (rw)
 		ret = set_memory_rw(addr, nrpages);
 	else
@@ -37,3 +40,347 @@ void pram_writeable(void *vaddr, unsigned long size, int rw)
 
 	BUG_ON(ret);
 }
+
+#ifdef CONFIG_X86
+/*
+ * Per-CPU write aliases, as text_poke() does for the kernel text. Every
+ * CPU owns a range of kernel virtual addresses where a window maps the
+ * pages to write with writable PTEs, and unmaps them with a local TLB
+ * flush when it's closed. The shared mapping stays read-only: only the
+ * writes through the alias get through, on that CPU and while the window
+ * is open. The window runs with preemption off and windows don't nest.
+ */
+#define PRAM_WP_ALIAS_PAGES	(PRAM_WP_BATCH / PAGE_SIZE + 1)
+
+struct pram_wp_alias {
+	struct vm_struct *area;
+	pte_t *ptes[PRAM_WP_ALIAS_PAGES];
+	unsigned int nr;		/* pages mapped */
+};
+
+static DEFINE_PER_CPU(struct pram_wp_alias, pram_wp_alias);
+
+/* Map len bytes at p, at most PRAM_WP_BATCH, and return their alias */
+void *pram_wp_alias_map(struct super_block *sb, void *p, unsigned long len)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long off = offset_in_page(p);
+	unsigned long pfn = (sbi->phys_addr + (p - sbi->virt_addr)) >>
+			    PAGE_SHIFT;
+	unsigned int i, nr = PAGE_ALIGN(off + len) >> PAGE_SHIFT;
+	struct pram_wp_alias *a;
+
+	BUG_ON(nr > PRAM_WP_ALIAS_PAGES);
+	preempt_disable();
+	a = this_cpu_ptr(&pram_wp_alias);
+	BUG_ON(a->nr);
+	/* same caching as the shared mapping, see pram_ioremap_wp() */
+	for (i = 0; i < nr; i++)
+		set_pte(a->ptes[i], pfn_pte(pfn + i, PAGE_KERNEL));
+	a->nr = nr;
+	return a->area->addr + off;
+}
+
+/* Write back and unmap the alias of len bytes at p */
+void pram_wp_alias_unmap(void *p, unsigned long len)
+{
+	struct pram_wp_alias *a = this_cpu_ptr(&pram_wp_alias);
+	unsigned long addr = (unsigned long)a->area->addr;
+	unsigned int i;
+
+	pram_flush_range(a->area->addr + offset_in_page(p), len);
+	for (i = 0; i < a->nr; i++, addr += PAGE_SIZE) {
+		set_pte(a->ptes[i], __pte(0));
+		__flush_tlb_one(addr);
+	}
+	a->nr = 0;
+	preempt_enable();
+}
+
+int __init init_pram_wprotect(void)
+{
+	struct pram_wp_alias *a;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		a = per_cpu_ptr(&pram_wp_alias, cpu);
+		a->area = alloc_vm_area(PRAM_WP_ALIAS_PAGES * PAGE_SIZE,
+					a->ptes);
+		if (!a->area) {
+			exit_pram_wprotect();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+void exit_pram_wprotect(void)
+{
+	struct pram_wp_alias *a;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		a = per_cpu_ptr(&pram_wp_alias, cpu);
+		if (a->area)
+			free_vm_area(a->area);
+		a->area = NULL;
+	}
+}
+#endif
+
+#ifdef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+/*
+ * CPU-local metadata windows. Clearing CR0.WP lets this CPU write every
+ * read-only page, not only the ones of the window: the kernel text and
+ * rodata and the whole filesystem are unprotected from this CPU, also for
+ * the NMIs and machine checks that run meanwhile. The interrupts are kept
+ * off while the window is open, so that only the code between the unlock
+ * and the lock gets to write, which adds to the interrupt latency. Windows
+ * nest, the outermost one restores the protection and the interrupts.
+ */
+struct pram_wp_window {
+	unsigned int depth;
+	unsigned long flags;
+};
+
+static DEFINE_PER_CPU(struct pram_wp_window, pram_wp_window);
+
+void pram_wp_local_open(void)
+{
+	struct pram_wp_window *w;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	w = this_cpu_ptr(&pram_wp_window);
+	if (!w->depth++) {
+		w->flags = flags;
+		write_cr0(read_cr0() & ~X86_CR0_WP);
+	}
+}
+
+void pram_wp_local_close(void)
+{
+	struct pram_wp_window *w = this_cpu_ptr(&pram_wp_window);
+
+	BUG_ON(!w->depth);
+	if (!--w->depth) {
+		write_cr0(read_cr0() | X86_CR0_WP);
+		local_irq_restore(w->flags);
+	}
+}
+#endif
+
+#ifndef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+/* Nodes kept for the windows opened where the allocations can't sleep */
+#define PRAM_WP_RESERVE		64
+
+/*
+ * Reference counts of the pages writable in the shared mapping.
+ *
+ * The windows of different tasks, and the pages kept by the batches, can
+ * overlap on the same page, e.g. an inode table page or the super block.
+ * A page is made writable when its first reference is taken and read-only
+ * again only when its last one is dropped, so that a window closed by a
+ * task can't protect a page that another one is still writing. The counts
+ * are kept per page in a hash of the sb, and the flips are done under its
+ * lock so that they follow the order of the counts: the mapping is made
+ * of small pages, the flips don't allocate. The windows of the mount time
+ * (see pram_memunlock_range_global()) don't take references, nothing else
+ * writes the filesystem meanwhile.
+ */
+struct pram_wp_page {
+	struct hlist_node node;
+	unsigned long addr;
+	unsigned long count;
+};
+
+int pram_wp_init(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	spin_lock_init(&sbi->s_wp_lock);
+	hash_init(sbi->s_wp_pages);
+	sbi->s_wp_pool = mempool_create_kmalloc_pool(PRAM_WP_RESERVE,
+					sizeof(struct pram_wp_page));
+	return sbi->s_wp_pool ? 0 : -ENOMEM;
+}
+
+void pram_wp_destroy(struct super_block *sb)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+
+	WARN_ON(!hash_empty(sbi->s_wp_pages));
+	if (sbi->s_wp_pool)
+		mempool_destroy(sbi->s_wp_pool);
+}
+
+static struct pram_wp_page *pram_wp_find(struct pram_sb_info *sbi,
+					 unsigned long addr)
+{
+	struct pram_wp_page *page;
+
+	hash_for_each_possible(sbi->s_wp_pages, page, node, addr)
+		if (page->addr == addr)
+			return page;
+	return NULL;
+}
+
+/* Take a reference on the pages of len bytes at p */
+void pram_wp_get(struct super_block *sb, void *p, unsigned long len)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long addr = (unsigned long)p & PAGE_MASK;
+	unsigned long end = PAGE_ALIGN((unsigned long)p + len);
+	unsigned long run = addr;	/* pages just referenced, still ro */
+	struct pram_wp_page *page, *new = NULL;
+
+	spin_lock(&sbi->s_wp_lock);
+	while (addr < end) {
+		page = pram_wp_find(sbi, addr);
+		if (!page && !new) {
+			/* the pages counted so far must be writable first */
+			if (run < addr)
+				pram_writeable((void *)run, addr - run, 1);
+			run = addr;
+			spin_unlock(&sbi->s_wp_lock);
+			/* it waits only if the reserve is out too */
+			new = mempool_alloc(sbi->s_wp_pool, GFP_NOFS);
+			spin_lock(&sbi->s_wp_lock);
+			continue;
+		}
+		if (!page) {
+			page = new;
+			new = NULL;
+			page->addr = addr;
+			page->count = 0;
+			hash_add(sbi->s_wp_pages, &page->node, addr);
+		}
+		if (page->count++) {
+			if (run < addr)
+				pram_writeable((void *)run, addr - run, 1);
+			run = addr + PAGE_SIZE;
+		}
+		addr += PAGE_SIZE;
+	}
+	if (run < end)
+		pram_writeable((void *)run, end - run, 1);
+	spin_unlock(&sbi->s_wp_lock);
+	if (new)
+		mempool_free(new, sbi->s_wp_pool);
+}
+
+/* Drop a reference on the pages of len bytes at p */
+void pram_wp_put(struct super_block *sb, void *p, unsigned long len)
+{
+	struct pram_sb_info *sbi = PRAM_SB(sb);
+	unsigned long addr = (unsigned long)p & PAGE_MASK;
+	unsigned long end = PAGE_ALIGN((unsigned long)p + len);
+	unsigned long run = addr;	/* pages unreferenced, still rw */
+	struct pram_wp_page *page;
+
+	spin_lock(&sbi->s_wp_lock);
+	for (; addr < end; addr += PAGE_SIZE) {
+		page = pram_wp_find(sbi, addr);
+		BUG_ON(!page);
+		if (--page->count) {
+			if (run < addr)
+				pram_writeable((void *)run, addr - run, 0);
+			run = addr + PAGE_SIZE;
+			continue;
+		}
+		hash_del(&page->node);
+		mempool_free(page, sbi->s_wp_pool);
+	}
+	if (run < end)
+		pram_writeable((void *)run, end - run, 0);
+	spin_unlock(&sbi->s_wp_lock);
+}
+
+/*
+ * Protection batches.
+ *
+ * A metadata operation, e.g. a create, unlocks the same pages several
+ * times, and every window flips the shared mapping with a TLB flush of
+ * all the CPUs. Between pram_wp_batch_begin() and pram_wp_batch_end() the
+ * batch holds a reference on the pages unlocked, so they stay writable
+ * and they're relocked at once at the end. The checksums are still
+ * computed when each window is closed, so that a crash in the middle of
+ * the operation leaves every inode valid.
+ *
+ * The batch belongs to the task, through current->journal_info, that
+ * another filesystem would take for its transaction handle. So it must not
+ * span anything that may enter another filesystem: a copy from userspace,
+ * that can fault, is left out of the batches, and the allocations in a
+ * batch don't reclaim from the filesystems, see pram_wp_batch_begin().
+ * A batch begun in another one, or in a transaction of another filesystem,
+ * does nothing.
+ */
+void pram_wp_batch_begin(struct super_block *sb, struct pram_wp_batch *batch)
+{
+	batch->sb = NULL;
+	if (current->journal_info)
+		return;
+
+	batch->magic = PRAM_WP_BATCH_MAGIC;
+	batch->sb = sb;
+	batch->nr_ranges = 0;
+	/*
+	 * The ACLs, the security xattrs and the inode table growth allocate
+	 * with GFP_KERNEL, and the reclaim could evict the inodes of another
+	 * filesystem with our batch in journal_info. There's no GFP_NOFS
+	 * scope, the NOIO one keeps the reclaim out of the filesystems too.
+	 */
+	batch->noio_flags = memalloc_noio_save();
+	current->journal_info = batch;
+}
+
+void pram_wp_batch_end(struct pram_wp_batch *batch)
+{
+	unsigned int i;
+
+	if (!batch->sb)
+		return;
+
+	current->journal_info = NULL;
+	memalloc_noio_restore(batch->noio_flags);
+	for (i = 0; i < batch->nr_ranges; i++)
+		pram_wp_put(batch->sb, (void *)batch->range[i].start,
+			    batch->range[i].end - batch->range[i].start);
+}
+
+static int pram_wp_batch_covers(struct pram_wp_batch *batch,
+				unsigned long start, unsigned long end)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->nr_ranges; i++)
+		if (start >= batch->range[i].start &&
+		    end <= batch->range[i].end)
+			return 1;
+	return 0;
+}
+
+/*
+ * Unlock a range in a batch. Its window takes its own reference, locked as
+ * usual, and the batch one more to keep the page writable until its end.
+ * The bulk writes, longer than a page, aren't kept, nor anything once the
+ * batch is out of ranges.
+ */
+void pram_wp_batch_unlock(struct pram_wp_batch *batch, void *p,
+			  unsigned long len)
+{
+	unsigned long start = (unsigned long)p & PAGE_MASK;
+	unsigned long end = PAGE_ALIGN((unsigned long)p + len);
+
+	pram_wp_get(batch->sb, p, len);
+	if (end - start > PAGE_SIZE ||
+	    batch->nr_ranges == PRAM_WP_BATCH_RANGES ||
+	    pram_wp_batch_covers(batch, start, end))
+		return;
+
+	pram_wp_get(batch->sb, p, len);
+	batch->range[batch->nr_ranges].start = start;
+	batch->range[batch->nr_ranges].end = end;
+	batch->nr_ranges++;
+}
+#endif
@@ -13,6 +13,8 @@
 #define __WPROTECT_H
 
 #include <linux/pram_fs.h>
+#include <linux/sched.h>
+#include "ntstore.h"
 
 /* pram_memunlock_super() before calling! */
 static inline void pram_sync_super(struct pram_super_block *ps)
@@ -37,8 +39,28 @@ static inline void pram_sync_inode(struct pram_inode *pi)
 	pi->i_sum = cpu_to_be32(crc);
 }
 
+/*
+ * Longest write window opened by the bulk writes, e.g. the copy of a run
+ * of file blocks, see pram_memunlock_alias().
+ */
+#define PRAM_WP_BATCH	(64 * 1024)
+
 #ifdef CONFIG_PRAMFS_WRITE_PROTECT
 extern void pram_writeable(void *vaddr, unsigned long size, int rw);
+#ifdef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+extern void pram_wp_local_open(void);
+extern void pram_wp_local_close(void);
+#endif
+#ifdef CONFIG_X86
+extern void *pram_wp_alias_map(struct super_block *sb, void *p,
+			       unsigned long len);
+extern void pram_wp_alias_unmap(void *p, unsigned long len);
+extern int init_pram_wprotect(void) __init;
+extern void exit_pram_wprotect(void);
+#else
+static inline int init_pram_wprotect(void) { return 0; }
+static inline void exit_pram_wprotect(void) {}
+#endif
 
 static inline int pram_is_protected(struct super_block *sb)
 {
@@ -46,35 +68,165 @@ static inline int pram_is_protected(struct super_block *sb)
 	return sbi->s_mount_opt & PRAM_MOUNT_PROTECT;
 }
 
-static inline void __pram_memunlock_range(void *p, unsigned long len)
+#ifndef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+/*
+ * Protection batch of a metadata operation, see pram_wp_batch_begin().
+ * It's pointed by current->journal_info while the operation runs.
+ */
+#define PRAM_WP_BATCH_MAGIC	0x7077626dU
+#define PRAM_WP_BATCH_RANGES	8
+
+struct pram_wp_batch {
+	unsigned int magic;
+	struct super_block *sb;		/* NULL if the batch is a no-op */
+	unsigned int noio_flags;	/* of memalloc_noio_save() */
+	unsigned int nr_ranges;		/* pages referenced until the end */
+	struct {
+		unsigned long start;
+		unsigned long end;
+	} range[PRAM_WP_BATCH_RANGES];
+};
+
+extern int pram_wp_init(struct super_block *sb);
+extern void pram_wp_destroy(struct super_block *sb);
+extern void pram_wp_get(struct super_block *sb, void *p, unsigned long len);
+extern void pram_wp_put(struct super_block *sb, void *p, unsigned long len);
+extern void pram_wp_batch_begin(struct super_block *sb,
+				struct pram_wp_batch *batch);
+extern void pram_wp_batch_end(struct pram_wp_batch *batch);
+extern void pram_wp_batch_unlock(struct pram_wp_batch *batch, void *p,
+				 unsigned long len);
+
+/* The batch of the current task on sb, if any */
+static inline struct pram_wp_batch *pram_wp_batch(struct super_block *sb)
 {
-	pram_writeable(p, len, 1);
+	struct pram_wp_batch *batch = current->journal_info;
+
+	if (batch && batch->magic == PRAM_WP_BATCH_MAGIC && batch->sb == sb)
+		return batch;
+	return NULL;
 }
+#else
+static inline int pram_wp_init(struct super_block *sb) { return 0; }
+static inline void pram_wp_destroy(struct super_block *sb) {}
+/* The CPU-local windows are cheap, there's nothing to batch */
+struct pram_wp_batch {};
+static inline void pram_wp_batch_begin(struct super_block *sb,
+				       struct pram_wp_batch *batch) {}
+static inline void pram_wp_batch_end(struct pram_wp_batch *batch) {}
+#endif
+
+/*
+ * The metadata windows flip the pages in the shared mapping, counting the
+ * windows open on each page (see pram_wp_get()). With
+ * CONFIG_PRAMFS_WRITE_PROTECT_CR0 they're CPU-local instead (see
+ * wprotect.c): cheap, but they lift the protection of all the read-only
+ * pages for this CPU and run with the interrupts off, so the code in
+ * between must not sleep or fault.
+ */
+static inline void __pram_memunlock_range(struct super_block *sb, void *p,
+					  unsigned long len)
+{
+#ifdef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+	pram_wp_local_open();
+#else
+	struct pram_wp_batch *batch = pram_wp_batch(sb);
 
-static inline void __pram_memlock_range(void *p, unsigned long len)
+	if (batch)
+		pram_wp_batch_unlock(batch, p, len);
+	else
+		pram_wp_get(sb, p, len);
+#endif
+}
+
+/*
+ * Closing a window is where the stores in it are made durable: there's
+ * no store to the protected memory out of a window.
+ */
+static inline void __pram_memlock_range(struct super_block *sb, void *p,
+					unsigned long len)
 {
-	pram_writeable(p, len, 0);
+#ifdef CONFIG_PRAMFS_WRITE_PROTECT_CR0
+	pram_flush_range(p, len);
+	pram_wp_local_close();
+#else
+	pram_flush_range(p, len);
+	pram_wp_put(sb, p, len);
+#endif
 }
 
 static inline void pram_memunlock_range(struct super_block *sb, void *p,
 					unsigned long len)
 {
 	if (pram_is_protected(sb))
-		__pram_memunlock_range(p, len);
+		__pram_memunlock_range(sb, p, len);
 }
 
 static inline void pram_memlock_range(struct super_block *sb, void *p,
 					unsigned long len)
 {
 	if (pram_is_protected(sb))
-		__pram_memlock_range(p, len);
+		__pram_memlock_range(sb, p, len);
+}
+
+/*
+ * Windows that may sleep or last long, only at mount time, flip the pages
+ * in the shared mapping without counting them.
+ */
+static inline void pram_memunlock_range_global(struct super_block *sb,
+					       void *p, unsigned long len)
+{
+	if (pram_is_protected(sb))
+		pram_writeable(p, len, 1);
+}
+
+static inline void pram_memlock_range_global(struct super_block *sb,
+					     void *p, unsigned long len)
+{
+	if (pram_is_protected(sb)) {
+		pram_flush_range(p, len);
+		pram_writeable(p, len, 0);
+	}
+}
+
+/*
+ * Open a write window on len bytes at p, at most PRAM_WP_BATCH, and return
+ * where to write them. On x86 it's a per-CPU alias of the pages (see
+ * wprotect.c), so it fits only the writers that go through the returned
+ * address, like the ones of the file data. The window can't sleep or
+ * fault.
+ */
+static inline void *pram_memunlock_alias(struct super_block *sb, void *p,
+					 unsigned long len)
+{
+	if (!pram_is_protected(sb))
+		return p;
+#ifdef CONFIG_X86
+	return pram_wp_alias_map(sb, p, len);
+#else
+	__pram_memunlock_range(sb, p, len);
+	return p;
+#endif
+}
+
+/* Close the window of pram_memunlock_alias(), p is the address it got */
+static inline void pram_memlock_alias(struct super_block *sb, void *p,
+				      unsigned long len)
+{
+	if (!pram_is_protected(sb))
+		return;
+#ifdef CONFIG_X86
+	pram_wp_alias_unmap(p, len);
+#else
+	__pram_memlock_range(sb, p, len);
+#endif
 }
 
 static inline void pram_memunlock_super(struct super_block *sb,
 					struct pram_super_block *ps)
 {
 	if (pram_is_protected(sb))
-		__pram_memunlock_range(ps, PRAM_SB_SIZE);
+		__pram_memunlock_range(sb, ps, PRAM_SB_SIZE);
 }
 
 static inline void pram_memlock_super(struct super_block *sb,
@@ -82,14 +234,14 @@ static inline void pram_memlock_super(struct super_block *sb,
 {
 	pram_sync_super(ps);
 	if (pram_is_protected(sb))
-		__pram_memlock_range(ps, PRAM_SB_SIZE);
+		__pram_memlock_range(sb, ps, PRAM_SB_SIZE);
 }
 
 static inline void pram_memunlock_inode(struct super_block *sb,
 					struct pram_inode *pi)
 {
 	if (pram_is_protected(sb))
-		__pram_memunlock_range(pi, PRAM_SB_SIZE);
+		__pram_memunlock_range(sb, pi, PRAM_SB_SIZE);
 }
 
 static inline void pram_memlock_inode(struct super_block *sb,
@@ -97,30 +249,49 @@ static inline void pram_memlock_inode(struct super_block *sb,
 {
 	pram_sync_inode(pi);
 	if (pram_is_protected(sb))
-		__pram_memlock_range(pi, PRAM_SB_SIZE);
+		__pram_memlock_range(sb, pi, PRAM_SB_SIZE);
 }
 
 static inline void pram_memunlock_block(struct super_block *sb,
 					void *bp)
 {
 	if (pram_is_protected(sb))
-		__pram_memunlock_range(bp, sb->s_blocksize);
+		__pram_memunlock_range(sb, bp, sb->s_blocksize);
 }
 
 static inline void pram_memlock_block(struct super_block *sb,
 					void *bp)
 {
 	if (pram_is_protected(sb))
-		__pram_memlock_range(bp, sb->s_blocksize);
+		__pram_memlock_range(sb, bp, sb->s_blocksize);
 }
 
 #else
 #define pram_is_protected(sb)	0
 #define pram_writeable(vaddr, size, rw) do {} while (0)
+static inline int init_pram_wprotect(void) { return 0; }
+static inline void exit_pram_wprotect(void) {}
+static inline int pram_wp_init(struct super_block *sb) { return 0; }
+static inline void pram_wp_destroy(struct super_block *sb) {}
+struct pram_wp_batch {};
+static inline void pram_wp_batch_begin(struct super_block *sb,
+				       struct pram_wp_batch *batch) {}
+static inline void pram_wp_batch_end(struct pram_wp_batch *batch) {}
 static inline void pram_memunlock_range(struct super_block *sb, void *p,
 					unsigned long len) {}
 static inline void pram_memlock_range(struct super_block *sb, void *p,
 					unsigned long len) {}
+static inline void *pram_memunlock_alias(struct super_block *sb, void *p,
+					 unsigned long len)
+{
+	return p;
+}
+static inline void pram_memlock_alias(struct super_block *sb, void *p,
+				      unsigned long len) {}
+static inline void pram_memunlock_range_global(struct super_block *sb,
+					       void *p, unsigned long len) {}
+static inline void pram_memlock_range_global(struct super_block *sb,
+					     void *p, unsigned long len) {}
 static inline void pram_memunlock_super(struct super_block *sb,
 					struct pram_super_block *ps) {}
 static inline void pram_memlock_super(struct super_block *sb,